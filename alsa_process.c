@@ -19,11 +19,28 @@
 #include "alsa_process.h"
 #include <alsa/asoundlib.h>
 #include <alsa/mixer.h>
+#include <pthread.h>
 #include "globals.h"
+#include "eventloop.h"
+#include "timerwheel.h"
+#include "alsa_cmdline.h"
+
+// the mixer rarely has more than one:
+#define ALSA_MAXFDS 4
+// how long the event loop leaves the mixer alone while the ALSA worker
+// is writing to it, in ms:
+#define ALSA_RETRY 10
 
 static snd_mixer_t *mixer_handle = NULL;
+// the event loop reads the mixer, and the ALSA worker writes to it:
+static pthread_mutex_t mixer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mixer_fds[ALSA_MAXFDS];
+static int nmixer_fds = 0;
+static wheel_timer_t retry;
 char alsa_card[MAXNAME] = ALSA_CARD;
 
+static int start_ALSA();
+
 int setup_ALSA()
 {
 	int err;
@@ -37,12 +54,65 @@ int setup_ALSA()
 	snd_mixer_attach(mixer_handle, alsa_card);
 	snd_mixer_selem_register(mixer_handle, NULL, NULL);
 	snd_mixer_load(mixer_handle);
+	return start_ALSA();
+}
+
+static void handle_mixer(void *data __attribute__((unused)))
+{
+	// keep our copy of the mixer up to date with changes from elsewhere
+	// (https://www.raspberrypi.org/forums/viewtopic.php?p=1165130)
+	// a slow driver can keep the ALSA worker in the mixer for a while.
+	// instead of waiting for it, stop watching and look again later:
+	if (pthread_mutex_trylock(&mixer_lock)) {
+		for (int i = 0; i < nmixer_fds; i++) {
+			eventloop_del(mixer_fds[i]);
+		}
+		timerwheel_add(&retry, ALSA_RETRY);
+		return;
+	}
+	snd_mixer_handle_events(mixer_handle);
+	pthread_mutex_unlock(&mixer_lock);
+}
+
+static void retry_mixer(wheel_timer_t *t __attribute__((unused)))
+{
+	if (pthread_mutex_trylock(&mixer_lock)) {
+		timerwheel_add(&retry, ALSA_RETRY);
+		return;
+	}
+	snd_mixer_handle_events(mixer_handle);
+	pthread_mutex_unlock(&mixer_lock);
+	for (int i = 0; i < nmixer_fds; i++) {
+		if (eventloop_add(mixer_fds[i], &handle_mixer, NULL))
+			stop_eventloop(-ENOSPC);
+	}
+}
+
+static int start_ALSA()
+{
+	struct pollfd pfd[ALSA_MAXFDS];
+	int n, err;
+
+	DBG("Starting ALSA mixer.");
+	n = snd_mixer_poll_descriptors(mixer_handle, pfd, ALSA_MAXFDS);
+	if (n < 0) {
+		ERR("Error getting mixer poll descriptors: %s.", snd_strerror(n));
+		return n;
+	}
+	retry.fn = &retry_mixer;
+	for (int i = 0; i < n; i++) {
+		err = eventloop_add(pfd[i].fd, &handle_mixer, NULL);
+		if (err)
+			return err;
+		mixer_fds[nmixer_fds++] = pfd[i].fd;
+	}
 	return 0;
 }
 
 int shutdown_ALSA()
 {
 	DBG("Shutting down ALSA mixer.");
+	timerwheel_del(&retry);
 	snd_mixer_close(mixer_handle);
 	return 0;
 }
@@ -70,21 +140,29 @@ int update_ALSA(control_t * c)
 	int err;
 
 	DBG("Setting mixer element %s to %d.", snd_mixer_selem_get_name(c->param1), c->value);
+	pthread_mutex_lock(&mixer_lock);
 	switch (c->type) {
 	case ROTARY:
+	case ANALOG:
 		// ALSA handles level in milliBel!
 		err = snd_mixer_selem_set_playback_dB_all(c->param1, c->value * 100, 1);
 		// set_ALSA_volume(c->param1, val * c->step * 100);
 		break;
 	case SWITCH:
+	case CHORD:
 		err = snd_mixer_selem_set_playback_switch_all(c->param1, c->value);
 		// set_ALSA_mute(c->param1, val);
 		break;
 	default:
+		pthread_mutex_unlock(&mixer_lock);
 		ERR("Unknown c->type %d. THIS SHOULD NEVER HAPPEN.", c->type);
 		return -EINVAL;
 		break;
 	}
+	// our own write is an event too. take it while we're in here,
+	// so that the event loop doesn't come knocking for it:
+	snd_mixer_handle_events(mixer_handle);
+	pthread_mutex_unlock(&mixer_lock);
 	if (err) {
 		ERR("ALSA error: %s while setting %s to %d.", snd_strerror(err),
 		    snd_mixer_selem_get_name(c->param1), c->value);
@@ -93,14 +171,16 @@ int update_ALSA(control_t * c)
 	return 0;
 }
 
-int get_ALSA_value(control_t* c)
+int get_ALSA_value(control_t* c, int *value)
 {
 	int err, res;
 	long i;
 
-	// make sure we're aware of mixer changes from elsewhere
-	// (https://www.raspberrypi.org/forums/viewtopic.php?p=1165130)
-	snd_mixer_handle_events(mixer_handle);
+	// mixer changes from elsewhere have been picked up by
+	// handle_mixer() already. if the ALSA worker is writing, we
+	// don't wait for it:
+	if (pthread_mutex_trylock(&mixer_lock))
+		return -EBUSY;
         switch (c->type) {
         case ROTARY:
                 // ALSA handles level in milliBel!
@@ -112,14 +192,38 @@ int get_ALSA_value(control_t* c)
                 // set_ALSA_mute(c->param1, val);
                 break;
         default:
+                pthread_mutex_unlock(&mixer_lock);
                 ERR("Unknown c->type %d. THIS SHOULD NEVER HAPPEN.", c->type);
                 return -EINVAL;
                 break;
         }
+	pthread_mutex_unlock(&mixer_lock);
         if (err) {
                 ERR("ALSA error: %s while reading %s.", snd_strerror(err),
                     snd_mixer_selem_get_name(c->param1));
                 return err;
         }
-        return res;
+        *value = res;
+        return 0;
+}
+
+static int setup_ALSA_control(control_t *c)
+{
+	c->param1 = setup_ALSA_elem(c->param1);
+	return (c->param1 == NULL) ? -ENOENT : 0;
 }
+
+output_t output_ALSA = {
+	.abi = OUTPUT_ABI,
+	.name = "alsa",
+	.help_rotary = &help_rotary_ALSA,
+	.help_switch = &help_switch_ALSA,
+	.parse_rotary = &parse_cmdline_rotary_ALSA,
+	.parse_switch = &parse_cmdline_switch_ALSA,
+	.setup = &setup_ALSA,
+	.setup_control = &setup_ALSA_control,
+	.update = &update_ALSA,
+	.shutdown = &shutdown_ALSA,
+	// drivers may take their time:
+	.blocking = 1
+};
@@ -21,11 +21,14 @@
 
 #include <alsa/asoundlib.h>
 #include "globals.h"
+#include "output.h"
+
+extern output_t output_ALSA;
 
 int setup_ALSA();
 int shutdown_ALSA();
 snd_mixer_elem_t *setup_ALSA_elem(char *mixer_scontrol);
-int get_ALSA_value(control_t* c);
+int get_ALSA_value(control_t* c, int *value);
 int update_ALSA(control_t* c);
 
 #endif
@@ -0,0 +1,223 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/* The one loop everything runs in.
+ *
+ * Every source of work is an fd in a single epoll set: GPIO line
+ * requests and input devices, polling timers, the OSC server socket,
+ * the ALSA mixer, the handover socket and a signalfd. Each wakeup first
+ * runs the handlers of all ready fds, then the after hooks, which is
+ * where batched work is flushed, and finally the timer wheel, so that
+ * timers see everything that happened before they fired. Since it all
+ * happens in one thread, nothing that handlers touch needs a lock.
+ * Only the outputs, which may block, are handed off to worker.c.
+ */
+
+#define _GNU_SOURCE // for sched_setaffinity()
+#include "eventloop.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include "globals.h"
+#include "timerwheel.h"
+
+#define FOREVER -1
+#define NEVER 0
+#define EVENTLOOP_MAXSOURCES 64
+#define EVENTLOOP_MAXAFTER 8
+#define EVENTLOOP_MAXEVENTS 16
+// epoll tag of the timer wheel:
+#define EVENTLOOP_WHEEL EVENTLOOP_MAXSOURCES
+
+#ifdef MALLOC_GUARD
+// test/malloc_guard.c, in test builds:
+void malloc_guard(int on);
+#endif
+
+typedef struct {
+	int fd; // -1 if the slot is free
+	void (*handler)(void *data);
+	void *data;
+} source_t;
+
+static source_t sources[EVENTLOOP_MAXSOURCES];
+static void (*after[EVENTLOOP_MAXAFTER])();
+static int nafter = 0;
+static int epfd = -1;
+// the cpu we spin on in busy-poll mode, or -1 to sleep in epoll_wait():
+static int spin_cpu = -1;
+static int running = 0;
+static int result = 0;
+
+int setup_eventloop(int cpu)
+{
+	struct epoll_event ev;
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	int err;
+
+	DBG("Setting up event loop.");
+	if (cpu >= CPU_SETSIZE || (ncpus > 0 && cpu >= ncpus)) {
+		ERR("There is no cpu %d on this system.", cpu);
+		return -EINVAL;
+	}
+	spin_cpu = cpu;
+	for (int i = 0; i < EVENTLOOP_MAXSOURCES; i++) {
+		sources[i].fd = -1;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ERR("epoll_create1: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	err = setup_timerwheel(EVENTLOOP_TICK);
+	if (err)
+		return err;
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENTLOOP_WHEEL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerwheel_fd(), &ev)) {
+		ERR("epoll_ctl(timer wheel): errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+int shutdown_eventloop()
+{
+	DBG("Shutting down event loop.");
+	shutdown_timerwheel();
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+	return 0;
+}
+
+int eventloop_add(int fd, void (*handler)(void *data), void *data)
+{
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < EVENTLOOP_MAXSOURCES && sources[i].fd >= 0; i++);
+	if (i == EVENTLOOP_MAXSOURCES) {
+		ERR("Can't watch more than %d fds.", EVENTLOOP_MAXSOURCES);
+		return -ENOSPC;
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERR("epoll_ctl(%d): errno = %d (%s).", fd, errno, strerror(errno));
+		return -errno;
+	}
+	sources[i].fd = fd;
+	sources[i].handler = handler;
+	sources[i].data = data;
+	return 0;
+}
+
+int eventloop_del(int fd)
+{
+	for (int i = 0; i < EVENTLOOP_MAXSOURCES; i++) {
+		if (sources[i].fd != fd)
+			continue;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		sources[i].fd = -1;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+int eventloop_after(void (*handler)())
+{
+	if (nafter == EVENTLOOP_MAXAFTER) {
+		ERR("Too many after hooks.");
+		return -ENOSPC;
+	}
+	after[nafter++] = handler;
+	return 0;
+}
+
+static int pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		ERR("sched_setaffinity(%d): errno = %d (%s).", cpu, errno, strerror(errno));
+		return -errno;
+	}
+	NFO("Busy-polling events on cpu %d. Make sure it is isolated.", cpu);
+	return 0;
+}
+
+int run_eventloop()
+{
+	struct epoll_event ev[EVENTLOOP_MAXEVENTS];
+	source_t *s;
+	int n, wheel;
+
+	DBG("Running event loop.");
+	if (spin_cpu >= 0) {
+		result = pin_cpu(spin_cpu);
+		if (result)
+			return result;
+	}
+	running = 1;
+#ifdef MALLOC_GUARD
+	// from here on, nothing should need the heap:
+	malloc_guard(1);
+#endif
+	while (running) {
+		// in busy-poll mode, we never sleep but come right back:
+		n = epoll_wait(epfd, ev, EVENTLOOP_MAXEVENTS, (spin_cpu < 0) ? FOREVER : NEVER);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			result = -errno;
+			ERR("epoll_wait: errno = %d (%s).", errno, strerror(errno));
+			break;
+		}
+		wheel = 0;
+		for (int i = 0; i < n; i++) {
+			if (ev[i].data.u32 == EVENTLOOP_WHEEL) {
+				wheel = 1;
+				continue;
+			}
+			s = &sources[ev[i].data.u32];
+			// an earlier handler may have removed it:
+			if (s->fd >= 0 && running)
+				s->handler(s->data);
+		}
+		for (int i = 0; i < nafter; i++) {
+			after[i]();
+		}
+		if (wheel && running)
+			timerwheel_expire();
+	}
+#ifdef MALLOC_GUARD
+	malloc_guard(0);
+#endif
+	return result;
+}
+
+void stop_eventloop(int err)
+{
+	// we finish the current wakeup, but don't wait for another one:
+	running = 0;
+	result = err;
+}
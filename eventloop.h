@@ -0,0 +1,32 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+// resolution of the timer wheel, in us:
+#define EVENTLOOP_TICK 10000
+
+int setup_eventloop(int cpu);
+int shutdown_eventloop();
+int eventloop_add(int fd, void (*handler)(void *data), void *data);
+int eventloop_del(int fd);
+int eventloop_after(void (*handler)());
+int run_eventloop();
+void stop_eventloop(int err);
+
+#endif
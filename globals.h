@@ -33,9 +33,14 @@
 // this seems to be the generic solution
 #define GPIOD_DEVICE "gpiochip0"
 
-#define MAXGPIO 64
-#define MAXSLAVE 16
-#define NCONTROLLERS (MAXGPIO + MAXSLAVE)
+#define MAXCHIP 8
+
+// pins are numbered globally across all chips.
+// chip 0 is GPIOD_DEVICE, so plain line numbers map to themselves.
+#define PIN_SHIFT 16
+#define PIN(chip,line) (((chip) << PIN_SHIFT) | (line))
+#define PIN_CHIP(pin) ((pin) >> PIN_SHIFT)
+#define PIN_LINE(pin) ((pin) & ((1 << PIN_SHIFT) - 1))
 #define MAXMIDICH 15
 #define MAXCCVAL 0x7f
 #define MAXCC 119
@@ -44,13 +49,38 @@
 #define MAXNAME 64
 #define ALSA_CARD "default"
 #define JACK_BUFSIZE 4096
+// rotary acceleration reaches its maximum at this many detents per second:
+#define DEFAULT_ACCEL_SPEED 50
+// default rate for chips that must be polled, in Hz:
+#define DEFAULT_POLL_RATE 1000
+// evdev devices are virtual chips, too. their lines are the KEY_* codes,
+// followed by the REL_* codes (KEY_CNT and REL_CNT in linux/input.h):
+#define EVDEV_KEYS 0x300
+#define EVDEV_RELS 0x10
+#define EVDEV_KEY_LINE(code) (code)
+#define EVDEV_REL_LINE(code) (EVDEV_KEYS + (code))
+// IIO devices are virtual chips whose lines are the in_voltageN channels:
+#define IIO_CHANNELS 32
+// analog inputs only report changes of more than this many ADC counts,
+#define DEFAULT_HYSTERESIS 4
+// of the average over this many samples:
+#define DEFAULT_DECIMATE 4
+// chords are matched over a bitmask of all switches:
+#define MAXCHORDSWITCHES 64
+// default scan rate for keypad matrices, in rows per second:
+#define DEFAULT_SCAN_RATE 4000
+// a press this long is a long press, in ms:
+#define DEFAULT_LONG_PRESS 500
+// and two clicks within this time are a double click:
+#define DEFAULT_DOUBLE_CLICK 300
 
 #define OSC_DELTA "/" PROGRAM_NAME "/delta"
 #define OSC_MUTE "/" PROGRAM_NAME "/mute"
 
 
-// one more than real max, so we can check for excess arguments:
-#define MAXARG 10
+// one more than real max, so we can check for excess arguments.
+// key=value options come on top of that:
+#define MAXARG 20
 
 #include <stdio.h>
 #include "build/config.h"
@@ -66,20 +96,28 @@
 #endif
 
 extern int verbose;
-extern int use_jack;
-extern int use_alsa;
-extern int use_osc;
-extern int use_stdout;
+extern int busy_cpu;
 extern int use_slave;
 
 typedef enum {
 	NOCTL,
 	AUX,
 	ROTARY,
-	SWITCH
+	SWITCH,
+	ANALOG,
+	CHORD
 } control_type_t;
 extern const char* control_types[];
 
+// what a switch controller reacts to. NOGESTURE is the plain press and
+// release, without any delay:
+typedef enum {
+	NOGESTURE,
+	CLICK,
+	LONGPRESS,
+	DOUBLECLICK
+} gesture_type_t;
+
 typedef enum {
 	NOTGT,
 	ALSA,
@@ -87,27 +125,73 @@ typedef enum {
 	OSC,
 	STDOUT,
 	MASTER,
-	SLAVE
+	SLAVE,
+	PLUGIN
 } control_target_t;
 extern const char* control_targets[];
 
-typedef struct {
-	unsigned char pin1;
-	unsigned char pin2;
+typedef struct control {
+	// everything update() and the targets touch for each event:
 	control_type_t type;
 	control_target_t target;
+	int value;
 	int min;
 	int max;
 	int step;
 	int toggle;
+	int urgent; // overtakes queued updates of other controllers
+	unsigned int pin1;
 	unsigned char midi_ch;
 	unsigned char midi_cc;
 	void *param1;
 	void *param2;
-	int value;
+	struct coalesce *coalesce; // NULL unless updates are coalesced
+	struct control *also; // the next target of the same input, or NULL
+	struct output *out; // see output.h
 } control_t;
 
-extern control_t *controller[];
+typedef struct {
+	// only needed until the inputs are set up:
+	unsigned int pin2;
+	int res;
+	int accel;
+	int accel_speed;
+	int debounce_min;
+	int debounce_max;
+	int hysteresis;
+	int decimate;
+	unsigned int *chord_pins; // the switches that make up a chord
+	int chord_size;
+	gesture_type_t gesture;
+	int gesture_ms; // long press threshold or double click window
+	int coalesce_ms;
+	int primary; // controller whose input this one is another target of, or -1
+} control_cfg_t;
+
+// a keypad matrix: rows are driven low one at a time, columns are read back.
+// keys are the lines of a virtual chip, numbered row * ncols + col.
+typedef struct {
+	unsigned int nrows;
+	unsigned int ncols;
+	unsigned int *rows; // pin numbers
+	unsigned int *cols;
+	int rate; // scan steps per second
+} matrix_t;
+
+// all controllers, in one contiguous block sized by the command line.
+// their setup details live in a parallel block, which is freed once the
+// inputs are running. controllers are only ever written, and copied for
+// the output workers, on the event loop thread, so they need no lock:
+extern control_t *controller;
+extern control_cfg_t *controller_cfg;
+#define CFG(c) (&controller_cfg[(c) - controller])
+extern int ncontrollers;
 extern char* osc_url;
+extern char* handover_path;
+extern char* gpio_chip[];
+extern int gpio_poll[];
+extern matrix_t *gpio_matrix[];
+extern int gpio_evdev[];
+extern int gpio_iio[];
 
 #endif
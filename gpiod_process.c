@@ -18,269 +18,2050 @@
 
 #include "gpiod_process.h"
 #include <gpiod.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <linux/gpio.h>
+#include <poll.h>
 #include "globals.h"
+#include "handover.h"
+#include "timerwheel.h"
+#include "eventloop.h"
 
-#define ACTIVE_HIGH 0
-#define ACTIVE_LOW 1
-#define FOREVER NULL
 #define NEVER 0
 #define NOAUX -1
+#define NOCHORD -1
+// switches that only exist as part of a chord have no controller:
+#define NOCTRL -1
 #define MAXNAME 64
 // debounce time windows, in us:
 #define GPI_DEBOUNCE_SWITCH 50
 #define GPI_DEBOUNCE_ROTARY 10
+// adaptive debouncing re-tunes a window every so many accepted edges:
+#define GPI_ADAPT_EDGES 16
+// and never trusts a gap longer than this (us):
+#define GPI_ADAPT_MAXGAP 1000000
+// number of edge events we can fetch from the kernel in one read():
+#define GPI_EVENT_BUFSIZE 64
+// number of edge events we process per wakeup, at most:
+#define GPI_BATCHSIZE (4 * GPI_EVENT_BUFSIZE)
 
 typedef enum {
 	GPI_NOTSET,
 	GPI_ROTARY,
 	GPI_SWITCH,
-	GPI_AUX
+	GPI_AUX,
+	GPI_MATRIX, // row or column of a keypad matrix
+	GPI_RELATIVE, // an axis of an evdev device, decoded by the kernel
+	GPI_ANALOG // a channel of an IIO device
 } line_type_t;
 
+typedef struct {
+	unsigned long long ts;
+	unsigned int line;
+	int value;
+} gpi_event_t;
+
+typedef enum {
+	GST_IDLE,
+	GST_DOWN, // pressed, could become a long press
+	GST_HELD, // long press
+	GST_UP, // released, could become a double click
+	GST_DOUBLE // pressed again
+} gesture_state_t;
+
+typedef struct {
+	wheel_timer_t timer; // first, so that the timer is the gesture
+	int ctl[DOUBLECLICK + 1]; // one controller per gesture, or NOCTRL
+	int long_ms;
+	int double_ms;
+	gesture_state_t state;
+} gesture_t;
+
 typedef struct {
 	line_type_t type;
 	unsigned int aux;
-	unsigned long ts_last;
+	unsigned long long ts_last;
 	int ts_delta;
+	int ctl;
+	signed char bit; // in the switch mask, or NOCHORD
+	gesture_t *gesture; // switches with gestures only
+	// adaptive debouncing, if db_max is set:
+	int db_min;
+	int db_max;
+	// analog channels:
+	int hysteresis; // in 16 bit units
+	int decimate;
+	int an_sum;
+	int an_count;
+	int an_last;
+	unsigned int bounce;
+	unsigned int gap;
+	unsigned int accepted;
+	// rotary only, kept in the clk line:
+	unsigned char state;
+	unsigned char res;
+	signed char count;
+	signed char dir;
+	unsigned int illegal;
+	unsigned long long ts_detent;
+	unsigned int interval;
+	int accel_max;
+	unsigned int accel_fast;
+	unsigned int accel_slow;
 } line_t;
 
-/* Yay. A bit-wise state machine :)
+/* Table-driven quadrature decoder.
  *
  * State:
- *   nnnn
- *   |||+----> clk bit
- *   ||+-----> dt bit
- *   |+------> clockwise bit
- *   +-------> outer ring bit
+ *   nn
+ *   |+----> clk bit
+ *   +-----> dt bit
+ *
+ * Every edge moves the state by one quarter step. We look up the
+ * direction of the move in a table indexed by (old state, new state):
  *
- * The clk and dt bits are set by interrupt handlers.
- * They can change rapidly when the switch hardware
- * bounces.
+ *   clockwise:          00 -> 01 -> 11 -> 10 -> 00
+ *   counter-clockwise:  00 -> 10 -> 11 -> 01 -> 00
  *
- * Two rings:
- *  Outer        1100*_    _1000*
- *                /    \  /    \
- *  Inner        /     0x00     \
- *              |      /  \      |
- *            1101  0010  0101  1010
-  *             |     |    |     |
- *               \  0011* 0111* /
- *                \    \  /    /
- *                 \___1x11___/ 
+ * Transitions that flip both bits are illegal (we missed an edge),
+ * and so are edges that don't change the state at all (we missed the
+ * edge in between). They are counted, but don't move the rotary.
  *
- * The starred states will fire a callback.
- * Between two unstarred states, we tolerate bouncing.
- * A starred state cannot bounce back, because we 
- * change rings immediately, so that it cannot trigger 
- * again.
- * We need two firing states per ring, because
- * in the (clk == dt) case, we cannot tell which
- * direction we're going.
+ * Quarter steps are summed up, and when the rotary arrives in one of
+ * the detent states for its resolution, the sum decides if and in which
+ * direction we fire. Bouncing back and forth between two states sums
+ * up to zero, so we tolerate it without debouncing.
  */
- 
+
 #define CLK 0x1
 #define DT 0x2
-#define CLOCKWISE 0x4
-#define OUTER 0x8
+#define QX 2 // illegal transition
+
+static const signed char quad_table[16] = {
+	/* from 00 to: 00  01  10  11 */
+	               QX, +1, -1, QX,
+	/* from 01 to: 00  01  10  11 */
+	               -1, QX, QX, +1,
+	/* from 10 to: 00  01  10  11 */
+	               +1, QX, QX, -1,
+	/* from 11 to: 00  01  10  11 */
+	               QX, -1, +1, QX
+};
+
+// which states are detents, as bit masks over the four states,
+// and how many quarter steps in one direction we need to fire:
+static const struct {
+	unsigned char detents;
+	signed char threshold;
+} quad_res[] = {
+	[1] = { 1 << (CLK | DT), 2 },		// full step, rest at 11
+	[2] = { 1 << 0 | 1 << (CLK | DT), 1 },	// half step, 00 and 11
+	[4] = { 0x0f, 1 }			// quarter step, every state
+};
+
+typedef struct {
+	int host; // the chip that has the row and column lines
+	unsigned int nrows;
+	unsigned int ncols;
+	unsigned int *offsets; // rows, then columns, on the host chip
+	struct gpiod_line_request *request;
+	enum gpiod_line_value *out; // row levels
+	enum gpiod_line_value *in; // column levels
+	unsigned char *raw; // last sample of each key
+	unsigned char *stable; // debounced level of each key
+	unsigned int row; // the row we are driving
+} scan_t;
 
-#define UPDATE(state,mask,value) (state = (state & ~mask) + (value & mask))
-#define IS_SET(state,mask) ((state & mask) == mask)
-#define IS_UNSET(state,mask) ((~state & mask) == mask)
+typedef struct {
+	unsigned int line; // the channel number
+	unsigned int index; // its position in the scan
+	unsigned int offset; // in bytes
+	unsigned int bytes;
+	unsigned int bits;
+	unsigned int shift;
+	char is_signed;
+	char big_endian;
+} iio_chan_t;
 
-#define SET(state,mask) (UPDATE(state, mask, ~0))
-#define UNSET(state,mask) (UPDATE(state, mask, 0))
-#define TOGGLE(state,mask) (state ^= mask)
+typedef struct {
+	char sysfs[MAXNAME + 32];
+	int standin; // a file or fifo instead of a real IIO device
+	int nchan;
+	iio_chan_t *chan; // in scan order
+	unsigned int scan_bytes;
+	unsigned char *buf;
+	unsigned int fill;
+} iio_t;
 
-#define FIRE_INNER(state) (IS_SET(state,(CLK | DT)) && IS_UNSET(state, OUTER))
-#define FIRE_OUTER(state) (IS_UNSET(state,(CLK | DT)) && IS_SET(state, OUTER)) 
+typedef struct {
+	char device[MAXNAME];
+	struct gpiod_chip *chip;
+	struct gpiod_line_request *request;
+	// or the fd of a request inherited from our predecessor, which
+	// libgpiod can't wrap, so we talk to the kernel directly:
+	int reqfd;
+	line_t *lines; // all lines of the chip, indexed by offset
+	unsigned int num_lines;
+	unsigned int *offsets; // the lines we actually request
+	int num_requested;
+	// chips without interrupts are polled at poll_rate Hz instead:
+	int poll_rate;
+	int timerfd;
+	enum gpiod_line_value *snapshot; // last values, in offsets order
+	enum gpiod_line_value *values; // scratch buffer for the next read
+	unsigned long long overruns;
+	// virtual chips for keypad matrices have no chip, but a scanner:
+	scan_t *matrix;
+	// evdev devices have no chip, but an input device:
+	int evdev;
+	unsigned long dropped;
+	// IIO devices have no chip, but a buffer:
+	int iiofd;
+	iio_t *iio;
+} chip_t;
 
- 
-static line_t *gpi[MAXGPIO] = { 0 };
+static chip_t chips[MAXCHIP] = { 0 };
 static void (*user_callback)();
 
-static unsigned int offsets[MAXGPIO] = { 0 };
-static int num_lines = 0;
-static int shutdown = 0;
+// constant-time lookup of a line by its global pin number,
+// see PIN() in globals.h:
+#define GPI(pin) (&chips[PIN_CHIP(pin)].lines[PIN_LINE(pin)])
+
+// edge-to-dispatch latency, in us. sampled inputs only know when we
+// saw a change, not when it happened, so they are kept apart:
+enum {
+	EDGES,
+	SAMPLES
+};
+static struct {
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long sum;
+	unsigned long count;
+} latency[2] = { { .min = ~0ULL }, { .min = ~0ULL } };
 
 static char consumer[MAXNAME];
-static char device[MAXNAME];
 
-static unsigned long long usec_stamp(struct timespec t)
+// all switches that can be part of a chord, one bit each, set when pressed:
+static uint64_t switch_state = 0;
+static int switch_bits = 0;
+
+typedef struct {
+	uint64_t mask;
+	int ctl;
+} chord_t;
+
+// chords in the order they were set up, and hashed by mask:
+static chord_t *chords = NULL;
+static int nchords = 0;
+static chord_t **chord_table = NULL;
+static unsigned int chord_hashbits = 0;
+// all switches that are part of any chord:
+static uint64_t chord_union = 0;
+static chord_t *active_chord = NULL;
+
+static int ngestures = 0;
+
+static struct gpiod_edge_event_buffer *event_buffer = NULL;
+static void chip_ready(void *data);
+static struct gpio_v2_line_event raw_events[GPI_EVENT_BUFSIZE];
+static gpi_event_t batch[GPI_BATCHSIZE];
+static int nbatch = 0;
+
+static unsigned long long usec_stamp(unsigned long long ns)
 {
-	return (unsigned long long)((t.tv_sec * 1000000ULL) + (t.tv_nsec / 1000ULL));
+	return ns / 1000ULL;
 }
 
-static char* uint_pp(unsigned int bitfield, int nbits) {
-	char* output = calloc(sizeof(char), nbits);
+static unsigned long long usec_now()
+{
+	struct timespec ts;
+
+	// same clock as the edge event timestamps:
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+static void account_latency(int kind, unsigned long long ts, unsigned long long now)
+{
+	unsigned long long lat = (now > ts) ? now - ts : 0;
+
+	if (lat < latency[kind].min)
+		latency[kind].min = lat;
+	if (lat > latency[kind].max)
+		latency[kind].max = lat;
+	latency[kind].sum += lat;
+	latency[kind].count++;
+}
+
+#ifdef DEBUG
+// output needs room for nbits digits and the terminating zero:
+static char* uint_pp(char *output, unsigned int bitfield, int nbits) {
 	for (int i=0; i<nbits; i++) {
 		int shift = nbits - i - 1;
 		output[i] = (char)(((bitfield & (1U << shift)) >> shift ) + '0');
 	}
+	output[nbits] = '\0';
 	return output;	
 }
+#endif
 
-static int handle_event(int event, unsigned int line, const struct timespec *timestamp,
-	     void *data)
+static int accelerate(line_t *r, int dir, unsigned long long now)
 {
-	unsigned long long now;
-	int value;
-	unsigned int* state;
+	unsigned long long iv;
+	unsigned long long range;
+
+	// detent intervals straight from the kernel timestamps,
+	// smoothed a little so a single fast click doesn't jump:
+	iv = now - r->ts_detent;
+	r->ts_detent = now;
+	if (dir != r->dir || iv > r->accel_slow) {
+		// changed direction or stopped in between
+		r->dir = dir;
+		r->interval = r->accel_slow;
+		return dir;
+	}
+	r->interval = (r->interval + iv) / 2;
+	if (r->interval >= r->accel_slow)
+		return dir;
+	if (r->interval <= r->accel_fast)
+		return dir * r->accel_max;
+	// quadratic ramp, so that moderate speeds stay precise:
+	range = r->accel_slow - r->accel_fast;
+	iv = r->accel_slow - r->interval;
+	return dir * (1 + (int)((r->accel_max - 1) * iv * iv / (range * range)));
+}
 
-	if (shutdown)
-		return GPIOD_CTXLESS_EVENT_CB_RET_STOP;
+static void handle_rotary(line_t *r, int bit, int value, unsigned long long now)
+{
+	unsigned char next;
+	signed char move;
+	int dir = 0;
+
+	DBG("state before: %s", uint_pp((char[3]){0}, r->state, 2));
+	next = value ? (r->state | bit) : (r->state & ~bit);
+	move = quad_table[r->state << 2 | next];
+	r->state = next;
+	if (move == QX) {
+		r->illegal++;
+		DBG("Illegal transition, %d so far.", r->illegal);
+		return;
+	}
+	r->count += move;
+	if (quad_res[r->res].detents & (1 << next)) {
+		if (r->count >= quad_res[r->res].threshold) {
+			dir = 1;
+		} else if (r->count <= -quad_res[r->res].threshold) {
+			dir = -1;
+		}
+		r->count = 0;
+	}
+	if (dir) {
+		if (r->accel_max > 1)
+			dir = accelerate(r, dir, now);
+		// both lines of a rotary point to the rotary's controller:
+		user_callback(r->ctl, dir);
+	}
+	DBG("state after: %s", uint_pp((char[3]){0}, r->state, 2));
+}
+
+static unsigned int chord_hash(uint64_t mask)
+{
+	// fibonacci hashing, the top bits are the best mixed:
+	return (mask * 0x9e3779b97f4a7c15ULL) >> (64 - chord_hashbits);
+}
+
+static chord_t *find_chord(uint64_t mask)
+{
+	unsigned int slot;
+
+	if (chord_table == NULL || mask == 0)
+		return NULL;
+	// the table is at most half full, so this ends quickly:
+	for (slot = chord_hash(mask); chord_table[slot] != NULL; slot = (slot + 1) & ((1 << chord_hashbits) - 1)) {
+		if (chord_table[slot]->mask == mask)
+			return chord_table[slot];
+	}
+	return NULL;
+}
+
+static void handle_chords(line_t *l, int value)
+{
+	uint64_t held;
+	chord_t *c;
+
+	if (value)
+		switch_state &= ~(1ULL << l->bit);
+	else
+		switch_state |= 1ULL << l->bit;
+	// a chord matches if exactly its switches are held, whatever
+	// else is going on. so one lookup covers all chords:
+	held = switch_state & chord_union;
+	if (active_chord != NULL && active_chord->mask == held)
+		return;
+	if (active_chord != NULL) {
+		user_callback(active_chord->ctl, 0);
+		active_chord = NULL;
+	}
+	c = find_chord(held);
+	if (c != NULL) {
+		active_chord = c;
+		user_callback(c->ctl, 1);
+	}
+}
+
+static void fire_gesture(gesture_t *g, gesture_type_t type, int delta)
+{
+	if (g->ctl[type] != NOCTRL)
+		user_callback(g->ctl[type], delta);
+}
+
+static void click(gesture_t *g)
+{
+	// a click is over by the time we know it was one:
+	fire_gesture(g, CLICK, 1);
+	fire_gesture(g, CLICK, 0);
+}
+
+static void gesture_timeout(wheel_timer_t *t)
+{
+	gesture_t *g = (gesture_t *)t;
+
+	if (g->state == GST_DOWN) {
+		fire_gesture(g, LONGPRESS, 1);
+		g->state = GST_HELD;
+	} else if (g->state == GST_UP) {
+		click(g);
+		g->state = GST_IDLE;
+	}
+}
+
+static void handle_gesture(gesture_t *g, int pressed)
+{
+	// a long press lasts until the release, and so does the second
+	// press of a double click. we only wait where a gesture is
+	// configured that could still happen:
+	switch (g->state) {
+	case GST_IDLE:
+		if (!pressed)
+			break;
+		g->state = GST_DOWN;
+		if (g->ctl[LONGPRESS] != NOCTRL)
+			timerwheel_add(&g->timer, g->long_ms);
+		break;
+	case GST_DOWN:
+		if (pressed)
+			break;
+		timerwheel_del(&g->timer);
+		if (g->ctl[DOUBLECLICK] != NOCTRL) {
+			g->state = GST_UP;
+			timerwheel_add(&g->timer, g->double_ms);
+		} else {
+			click(g);
+			g->state = GST_IDLE;
+		}
+		break;
+	case GST_HELD:
+		if (pressed)
+			break;
+		fire_gesture(g, LONGPRESS, 0);
+		g->state = GST_IDLE;
+		break;
+	case GST_UP:
+		if (!pressed)
+			break;
+		timerwheel_del(&g->timer);
+		fire_gesture(g, DOUBLECLICK, 1);
+		g->state = GST_DOUBLE;
+		break;
+	case GST_DOUBLE:
+		if (pressed)
+			break;
+		fire_gesture(g, DOUBLECLICK, 0);
+		g->state = GST_IDLE;
+		break;
+	}
+}
+
+static void adapt_debounce(line_t *l, unsigned long long iv, int rejected)
+{
+	int window;
+	int bouncing = rejected;
+
+	if (iv > GPI_ADAPT_MAXGAP)
+		iv = GPI_ADAPT_MAXGAP;
+	// an edge that got through but came much sooner than usual was
+	// most likely a bounce longer than the current window:
+	if (!rejected && iv <= l->db_max && iv < l->gap / 4)
+		bouncing = 1;
+	if (bouncing) {
+		// peak tracker: jump to the longest bounce we see...
+		if (iv > l->bounce)
+			l->bounce = iv;
+	} else {
+		// ...and let it decay while the contact behaves:
+		l->bounce -= l->bounce / 16;
+		// average gap between real edges:
+		l->gap = l->gap + ((int)iv - (int)l->gap) / 8;
+	}
+	if (rejected || ++l->accepted % GPI_ADAPT_EDGES)
+		return;
+	// cover the bounces with some margin, but stay well below the
+	// gap between real edges, so we don't eat fast detents:
+	window = 2 * l->bounce;
+	if (window > l->gap / 2)
+		window = l->gap / 2;
+	if (window < l->db_min)
+		window = l->db_min;
+	if (window > l->db_max)
+		window = l->db_max;
+	if (window != l->ts_delta) {
+		DBG("Debounce window %d -> %d us (bounce %d us, gap %d us).",
+		    l->ts_delta, window, l->bounce, l->gap);
+		l->ts_delta = window;
+	}
+}
+
+static int handle_event(unsigned int line, int value, unsigned long long now)
+{
+	line_t *l = GPI(line);
+	int dir;
 
-	now = usec_stamp(*timestamp);
 	DBG("GPIOD handler at time %lld", now);
-	value = (event == GPIOD_CTXLESS_EVENT_CB_RISING_EDGE) ? 1 : 0;
-	if ((now - gpi[line]->ts_last) > gpi[line]->ts_delta) {
+	// if the kernel debounces this line for us, ts_delta is 0.
+	// otherwise, this is our fallback:
+	if (l->ts_delta == 0 || (now - l->ts_last) > l->ts_delta) {
 		// we're not bouncing:
-		gpi[line]->ts_last = now;
-		switch (gpi[line]->type) {
+		if (l->db_max)
+			adapt_debounce(l, now - l->ts_last, 0);
+		l->ts_last = now;
+		switch (l->type) {
 		case GPI_ROTARY:
-			// lazy hack:
-			// store current value in aux field,
-			// because an aux can't have an aux.
-			state = &(gpi[gpi[line]->aux]->aux);
-			UPDATE(*state, CLK, ~0 * value);
+			handle_rotary(l, CLK, value, now);
 			break;
 		case GPI_AUX:
-			state = &(gpi[line]->aux);
-			UPDATE(*state, DT, ~0 * value);
+			// the aux line points back to the clk line,
+			// which holds the state:
+			handle_rotary(GPI(l->aux), DT, value, now);
 			break;
 		case GPI_SWITCH:
-			user_callback(line, 1 - value); // look for falling edge
-			return GPIOD_CTXLESS_EVENT_CB_RET_OK; // skip state machine
+			if (l->ctl != NOCTRL)
+				user_callback(l->ctl, 1 - value); // look for falling edge
+			if (l->bit != NOCHORD && chord_union & (1ULL << l->bit))
+				handle_chords(l, value);
+			if (l->gesture != NULL)
+				handle_gesture(l->gesture, 1 - value);
+			break;
+		case GPI_ANALOG:
+			// value is the position, scaled to 16 bits:
+			user_callback(l->ctl, value);
+			break;
+		case GPI_RELATIVE:
+			// value is the number of detents, with a sign:
+			dir = (value > 0) - (value < 0);
+			if (l->accel_max > 1)
+				dir = accelerate(l, dir, now);
+			user_callback(l->ctl, dir * abs(value));
 			break;
 		default:
 			ERR("No handler for type %d. THIS SHOULD NEVER HAPPEN.",
-			    gpi[line]->type);
-			return GPIOD_CTXLESS_EVENT_CB_RET_ERR;
+			    l->type);
+			return -EINVAL;
 			break;
 		}
-		DBG("state before: %s", uint_pp(*state, 4));
-		// which direction?
-		if (IS_SET(*state, OUTER)) {
-			if (IS_UNSET(*state, CLK) && IS_SET(*state, DT)) 
-				SET(*state, CLOCKWISE);
-			else if (IS_SET(*state, CLK) && IS_UNSET(*state, DT))
-				UNSET(*state, CLOCKWISE);
-		} else {
-			if (IS_SET(*state, CLK) && IS_UNSET(*state, DT)) 
-                                SET(*state, CLOCKWISE);
-                        else if (IS_UNSET(*state, CLK) && IS_SET(*state, DT))
-                                UNSET(*state, CLOCKWISE);
-		}
-		if (FIRE_INNER(*state)) {
-			user_callback(line, -1 + 2 * IS_SET(*state, CLOCKWISE));	
-			SET(*state, OUTER);
-		} else if (FIRE_OUTER(*state)) {
-			user_callback(line, -1 + 2 * IS_SET(*state, CLOCKWISE));
-			UNSET(*state, OUTER);
-		}
-		DBG("state after: %s", uint_pp(*state, 4));
+	} else if (l->db_max) {
+		adapt_debounce(l, now - l->ts_last, 1);
 	}
-	return GPIOD_CTXLESS_EVENT_CB_RET_OK;
+	return 0;
+}
+
+static int check_pin(int pin)
+{
+	chip_t *ch = &chips[PIN_CHIP(pin)];
+
+	if (PIN_CHIP(pin) >= MAXCHIP || ch->lines == NULL) {
+		ERR("Pin %d:%d is on a chip that has not been set up.", PIN_CHIP(pin), PIN_LINE(pin));
+		return -ENODEV;
+	}
+	if (PIN_LINE(pin) >= ch->num_lines) {
+		ERR("%s only has %d lines, there is no line %d.", ch->device, ch->num_lines, PIN_LINE(pin));
+		return -EINVAL;
+	}
+	return 0;
 }
 
-int setup_GPIOD_rotary(int line, int aux)
+int setup_GPIOD_rotary(int line, int aux, int res, int ctl)
 {
-	DBG("Adding rotary on pins %d and %d.", line, aux);
-	if (gpi[line] != NULL) {
-		ERR("Line %d is already in use: %d.", line, gpi[line]->type);
+	DBG("Adding rotary on pins %d:%d and %d:%d.", PIN_CHIP(line), PIN_LINE(line), PIN_CHIP(aux), PIN_LINE(aux));
+	if (res != 1 && res != 2 && res != 4) {
+		ERR("Resolution must be 1, 2 or 4, not %d.", res);
+		return -EINVAL;
+	}
+	if (check_pin(line) || check_pin(aux))
+		return -EINVAL;
+	if (GPI(line)->type != GPI_NOTSET) {
+		ERR("Line %d is already in use: %d.", line, GPI(line)->type);
 		return -EBUSY;
 	}
-	if (gpi[aux] != NULL) {
-		ERR("Aux %d is already in use: %d.", aux, gpi[aux]->type);
+	if (chips[PIN_CHIP(line)].evdev) {
+		// the kernel has done all the decoding, and there is no aux:
+		if (line < PIN(PIN_CHIP(line), EVDEV_REL_LINE(0))) {
+			ERR("%s: rotaries need a relative axis.", chips[PIN_CHIP(line)].device);
+			return -EINVAL;
+		}
+		GPI(line)->type = GPI_RELATIVE;
+		GPI(line)->ts_last = NEVER;
+		GPI(line)->ts_delta = 0;
+		GPI(line)->ctl = ctl;
+		chips[PIN_CHIP(line)].num_requested++;
+		return 0;
+	}
+	if (GPI(aux)->type != GPI_NOTSET) {
+		ERR("Aux %d is already in use: %d.", aux, GPI(aux)->type);
 		return -EBUSY;
 	}
 	if (line == aux) {
 		ERR("Line and Aux line cannot both be %d.", line);
 		return -EINVAL;
 	}
-	gpi[line] = calloc(sizeof(line_t), 1);
-	if (gpi[line] == NULL) {
+	GPI(line)->type = GPI_ROTARY;
+	GPI(line)->aux = aux;
+	GPI(line)->ts_last = NEVER;
+	GPI(line)->ts_delta = GPI_DEBOUNCE_ROTARY;
+	GPI(line)->ctl = ctl;
+	GPI(line)->res = res;
+	GPI(aux)->type = GPI_AUX;
+	GPI(aux)->aux = line;
+	GPI(aux)->ts_last = NEVER;
+	GPI(aux)->ts_delta = GPI_DEBOUNCE_ROTARY;
+	GPI(aux)->ctl = ctl;
+	chips[PIN_CHIP(line)].num_requested++;
+	chips[PIN_CHIP(aux)].num_requested++;
+	return 0;
+}
+
+int setup_GPIOD_accel(int line, int max, int speed)
+{
+	DBG("Accelerating rotary on pin %d:%d up to %dx at %d detents/s.", PIN_CHIP(line), PIN_LINE(line), max, speed);
+	if (check_pin(line))
+		return -EINVAL;
+	if (GPI(line)->type != GPI_ROTARY && GPI(line)->type != GPI_RELATIVE) {
+		ERR("Line %d is not a rotary.", line);
+		return -EINVAL;
+	}
+	if (max < 1 || speed < 1) {
+		ERR("Acceleration factor and speed must be positive.");
+		return -EINVAL;
+	}
+	// all in us per detent:
+	GPI(line)->accel_max = max;
+	GPI(line)->accel_fast = 1000000 / speed;
+	GPI(line)->accel_slow = 10 * GPI(line)->accel_fast;
+	GPI(line)->interval = GPI(line)->accel_slow;
+	return 0;
+}
+
+int setup_GPIOD_debounce(int line, int min, int max)
+{
+	line_t *l;
+
+	DBG("Adaptive debouncing on pin %d:%d between %d and %d us.", PIN_CHIP(line), PIN_LINE(line), min, max);
+	if (check_pin(line))
+		return -EINVAL;
+	if (min < 0 || max < 1 || min > max) {
+		ERR("Invalid debounce range %d..%d.", min, max);
+		return -EINVAL;
+	}
+	if (chips[PIN_CHIP(line)].evdev) {
+		ERR("%s is debounced by its kernel driver.", chips[PIN_CHIP(line)].device);
+		return -EINVAL;
+	}
+	l = GPI(line);
+	l->db_min = min;
+	l->db_max = max;
+	if (l->ts_delta < min)
+		l->ts_delta = min;
+	if (l->ts_delta > max)
+		l->ts_delta = max;
+	l->bounce = l->ts_delta / 2;
+	l->gap = GPI_ADAPT_MAXGAP;
+	return 0;
+}
+
+int setup_GPIOD_switch(int line, int ctl)
+{
+	DBG("Adding switch on pin %d:%d.", PIN_CHIP(line), PIN_LINE(line));
+	if (check_pin(line))
+		return -EINVAL;
+	if (GPI(line)->type != GPI_NOTSET) {
+		ERR("Line %d is already in use: %d.", line, GPI(line)->type);
+		return -EBUSY;
+	}
+	if (chips[PIN_CHIP(line)].evdev && line >= PIN(PIN_CHIP(line), EVDEV_REL_LINE(0))) {
+		ERR("%s: switches need a key code.", chips[PIN_CHIP(line)].device);
+		return -EINVAL;
+	}
+	GPI(line)->type = GPI_SWITCH;
+	GPI(line)->aux = NOAUX;
+	// only switches that are in a chord get a bit, see below:
+	GPI(line)->bit = NOCHORD;
+	GPI(line)->ts_last = NEVER;
+	// evdev keys have been debounced by the kernel driver:
+	GPI(line)->ts_delta = chips[PIN_CHIP(line)].evdev ? 0 : GPI_DEBOUNCE_SWITCH;
+	GPI(line)->ctl = ctl;
+	chips[PIN_CHIP(line)].num_requested++;
+	return 0;
+}
+
+int setup_GPIOD_chord(unsigned int *pins, int n, int ctl)
+{
+	chord_t *tmp;
+	uint64_t mask = 0;
+	int err;
+
+	DBG("Adding chord of %d switches.", n);
+	if (n < 2) {
+		ERR("A chord needs at least two switches.");
+		return -EINVAL;
+	}
+	for (int i = 0; i < n; i++) {
+		if (check_pin(pins[i]))
+			return -EINVAL;
+		// a switch can be used on its own and in chords, but it
+		// need not be:
+		if (GPI(pins[i])->type == GPI_NOTSET) {
+			err = setup_GPIOD_switch(pins[i], NOCTRL);
+			if (err)
+				return err;
+		}
+		if (GPI(pins[i])->type != GPI_SWITCH) {
+			ERR("Line %d:%d is not a switch.", PIN_CHIP(pins[i]), PIN_LINE(pins[i]));
+			return -EINVAL;
+		}
+		if (GPI(pins[i])->bit == NOCHORD) {
+			if (switch_bits == MAXCHORDSWITCHES) {
+				ERR("Only %d different switches can be used in chords.", MAXCHORDSWITCHES);
+				return -EINVAL;
+			}
+			GPI(pins[i])->bit = switch_bits++;
+		}
+		mask |= 1ULL << GPI(pins[i])->bit;
+	}
+	for (int i = 0; i < nchords; i++) {
+		if (chords[i].mask == mask) {
+			ERR("There already is a chord of these switches.");
+			return -EBUSY;
+		}
+	}
+	tmp = realloc(chords, (nchords + 1) * sizeof(chord_t));
+	if (tmp == NULL) {
+		ERR("realloc() failed.");
+		return -ENOMEM;
+	}
+	chords = tmp;
+	chords[nchords].mask = mask;
+	chords[nchords].ctl = ctl;
+	nchords++;
+	chord_union |= mask;
+	return 0;
+}
+
+int setup_GPIOD_gesture(int line, int gesture, int ms, int ctl)
+{
+	line_t *l;
+	gesture_t *g;
+	int err;
+
+	DBG("Adding gesture %d on pin %d:%d.", gesture, PIN_CHIP(line), PIN_LINE(line));
+	if (check_pin(line))
+		return -EINVAL;
+	l = GPI(line);
+	// gestures can share a switch with a plain controller, but need not:
+	if (l->type == GPI_NOTSET) {
+		err = setup_GPIOD_switch(line, NOCTRL);
+		if (err)
+			return err;
+	}
+	if (l->type != GPI_SWITCH) {
+		ERR("Line %d:%d is not a switch.", PIN_CHIP(line), PIN_LINE(line));
+		return -EINVAL;
+	}
+	if (gesture < CLICK || gesture > DOUBLECLICK || ms < 1) {
+		ERR("Invalid gesture %d (%d ms).", gesture, ms);
+		return -EINVAL;
+	}
+	if (l->gesture == NULL) {
+		g = calloc(1, sizeof(gesture_t));
+		if (g == NULL) {
+			ERR("calloc() failed.");
+			return -ENOMEM;
+		}
+		for (int i = 0; i <= DOUBLECLICK; i++) {
+			g->ctl[i] = NOCTRL;
+		}
+		g->timer.fn = &gesture_timeout;
+		l->gesture = g;
+		ngestures++;
+	}
+	g = l->gesture;
+	if (g->ctl[gesture] != NOCTRL) {
+		ERR("Line %d:%d already has a controller for gesture %d.", PIN_CHIP(line), PIN_LINE(line), gesture);
+		return -EBUSY;
+	}
+	g->ctl[gesture] = ctl;
+	if (gesture == LONGPRESS)
+		g->long_ms = ms;
+	if (gesture == DOUBLECLICK)
+		g->double_ms = ms;
+	return 0;
+}
+
+static int build_chords()
+{
+	unsigned int slot;
+
+	if (nchords == 0)
+		return 0;
+	// at least twice as many slots as chords:
+	for (chord_hashbits = 1; (1 << chord_hashbits) < 2 * nchords; chord_hashbits++);
+	chord_table = calloc(sizeof(chord_t *), 1 << chord_hashbits);
+	if (chord_table == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	for (int i = 0; i < nchords; i++) {
+		for (slot = chord_hash(chords[i].mask); chord_table[slot] != NULL; slot = (slot + 1) & ((1 << chord_hashbits) - 1));
+		chord_table[slot] = &chords[i];
+	}
+	DBG("%d chords in %d slots.", nchords, 1 << chord_hashbits);
+	return 0;
+}
+
+int setup_GPIOD_matrix(int index, char *name, matrix_t *m)
+{
+	chip_t *ch;
+	scan_t *s;
+	unsigned int n = m->nrows + m->ncols;
+	unsigned int pin;
+
+	DBG("Setting up %dx%d matrix %s.", m->nrows, m->ncols, name);
+	if (index < 0 || index >= MAXCHIP) {
+		ERR("Chip index %d out of range.", index);
+		return -EINVAL;
+	}
+	if (m->rate < 1 || m->rate > 1000000) {
+		ERR("Invalid scan rate %d Hz.", m->rate);
+		return -EINVAL;
+	}
+	ch = &chips[index];
+	s = calloc(sizeof(scan_t), 1);
+	if (s == NULL) {
 		ERR("calloc() failed.");
 		return -ENOMEM;
 	}
-	gpi[aux] = calloc(sizeof(line_t), 1);
-	if (gpi[aux] == NULL) {
+	ch->matrix = s;
+	s->host = PIN_CHIP(m->rows[0]);
+	s->nrows = m->nrows;
+	s->ncols = m->ncols;
+	s->offsets = calloc(sizeof(unsigned int), n);
+	s->out = calloc(sizeof(enum gpiod_line_value), m->nrows);
+	s->in = calloc(sizeof(enum gpiod_line_value), m->ncols);
+	s->raw = calloc(sizeof(unsigned char), m->nrows * m->ncols);
+	s->stable = calloc(sizeof(unsigned char), m->nrows * m->ncols);
+	if (s->offsets == NULL || s->out == NULL || s->in == NULL
+	    || s->raw == NULL || s->stable == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	// the scan needs a single request for rows and columns:
+	for (unsigned int i = 0; i < n; i++) {
+		pin = (i < m->nrows) ? m->rows[i] : m->cols[i - m->nrows];
+		if (check_pin(pin))
+			return -EINVAL;
+		if (PIN_CHIP(pin) != s->host) {
+			ERR("All rows and columns of %s must be on the same chip.", name);
+			return -EINVAL;
+		}
+		if (chips[s->host].chip == NULL) {
+			ERR("The rows and columns of %s must be on a GPIO chip.", name);
+			return -EINVAL;
+		}
+		if (GPI(pin)->type != GPI_NOTSET) {
+			ERR("Line %d:%d is already in use: %d.", PIN_CHIP(pin), PIN_LINE(pin), GPI(pin)->type);
+			return -EBUSY;
+		}
+		GPI(pin)->type = GPI_MATRIX;
+		s->offsets[i] = PIN_LINE(pin);
+	}
+	// all keys start released, i.e. pulled up:
+	memset(s->raw, 1, m->nrows * m->ncols);
+	memset(s->stable, 1, m->nrows * m->ncols);
+	for (unsigned int i = 0; i < m->nrows; i++) {
+		s->out[i] = GPIOD_LINE_VALUE_ACTIVE;
+	}
+	s->out[0] = GPIOD_LINE_VALUE_INACTIVE;
+	strncpy(ch->device, name, MAXNAME - 1);
+	ch->num_lines = m->nrows * m->ncols;
+	ch->poll_rate = m->rate;
+	ch->lines = calloc(sizeof(line_t), ch->num_lines);
+	if (ch->lines == NULL) {
 		ERR("calloc() failed.");
 		return -ENOMEM;
 	}
-	gpi[line]->type = GPI_ROTARY;
-	gpi[line]->aux = aux;
-	gpi[line]->ts_last = NEVER;
-	gpi[line]->ts_delta = GPI_DEBOUNCE_ROTARY;
-	gpi[aux]->type = GPI_AUX;
-	gpi[aux]->aux = 0;
-	gpi[aux]->ts_last = NEVER;
-	gpi[line]->ts_delta = GPI_DEBOUNCE_ROTARY;
 	return 0;
 }
 
-int setup_GPIOD_switch(int line)
+int setup_GPIOD_evdev(int index, char *dev)
 {
-	DBG("Adding switch on pin %d.", line);
-	if (gpi[line] != NULL) {
-		ERR("Line %d is already in use: %d.", line, gpi[line]->type);
-		return -EBUSY;
+	chip_t *ch;
+	char name[MAXNAME] = "unknown";
+	int clock = CLOCK_MONOTONIC;
+
+	DBG("Setting up evdev device %d (%s).", index, dev);
+	if (index < 0 || index >= MAXCHIP) {
+		ERR("Chip index %d out of range.", index);
+		return -EINVAL;
+	}
+	ch = &chips[index];
+	if (dev[0] == '/') {
+		strncpy(ch->device, dev, MAXNAME - 1);
+	} else {
+		snprintf(ch->device, MAXNAME, "/dev/%s", dev);
+	}
+	ch->evdev = open(ch->device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (ch->evdev < 0) {
+		ERR("open(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		ch->evdev = 0;
+		return -ENODEV;
+	}
+	ioctl(ch->evdev, EVIOCGNAME(sizeof(name)), name);
+	NFO("Using %s (%s).", ch->device, name);
+	// stamp events with the same clock as the gpio chips, so we can
+	// merge them:
+	if (ioctl(ch->evdev, EVIOCSCLOCKID, &clock))
+		ERR("%s: could not switch to the monotonic clock, timestamps will be off.", ch->device);
+	// keep keypresses from ending up on the console as well:
+	if (ioctl(ch->evdev, EVIOCGRAB, 1)) {
+		DBG("Could not grab %s: errno = %d (%s).", ch->device, errno, strerror(errno));
 	}
-	gpi[line] = calloc(sizeof(line_t), 1);
-	if (gpi[line] == NULL) {
+	ch->num_lines = EVDEV_KEYS + EVDEV_RELS;
+	ch->lines = calloc(sizeof(line_t), ch->num_lines);
+	if (ch->lines == NULL) {
 		ERR("calloc() failed.");
 		return -ENOMEM;
 	}
-	gpi[line]->type = GPI_SWITCH;
-	gpi[line]->aux = NOAUX;
-	gpi[line]->ts_last = NEVER;
-	gpi[line]->ts_delta = GPI_DEBOUNCE_SWITCH;
 	return 0;
 }
 
-int shutdown_GPIOD()
+int setup_GPIOD_iio(int index, char *dev)
 {
-	DBG("Shutting down GPIOD.");
-	// FIXME: This won't do anything useful unless all lines are being triggered afterwards.
-	// We should provide a poll callback and initiate the shutdown there.
-	// Then again, all lines are realeased when the process terminates.
-        shutdown = 1;
+	chip_t *ch;
+	iio_t *d;
+	struct stat st;
+	char *name;
+
+	DBG("Setting up IIO device %d (%s).", index, dev);
+	if (index < 0 || index >= MAXCHIP) {
+		ERR("Chip index %d out of range.", index);
+		return -EINVAL;
+	}
+	ch = &chips[index];
+	if (dev[0] == '/') {
+		strncpy(ch->device, dev, MAXNAME - 1);
+	} else {
+		snprintf(ch->device, MAXNAME, "/dev/%s", dev);
+	}
+	d = calloc(sizeof(iio_t), 1);
+	if (d == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	ch->iio = d;
+	name = strrchr(ch->device, '/') + 1;
+	snprintf(d->sysfs, sizeof(d->sysfs), "/sys/bus/iio/devices/%s", name);
+	// anything that isn't backed by sysfs is a stand-in for testing:
+	if (stat(d->sysfs, &st) || !S_ISDIR(st.st_mode)) {
+		NFO("%s is not an IIO device, reading it as a stand-in.", ch->device);
+		d->standin = 1;
+	}
+	ch->num_lines = IIO_CHANNELS;
+	ch->lines = calloc(sizeof(line_t), ch->num_lines);
+	if (ch->lines == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int setup_GPIOD_analog(int line, int ctl, int hysteresis, int decimate)
+{
+	DBG("Adding analog input on %d:%d.", PIN_CHIP(line), PIN_LINE(line));
+	if (check_pin(line))
+		return -EINVAL;
+	if (chips[PIN_CHIP(line)].iio == NULL) {
+		ERR("%s is not an IIO device.", chips[PIN_CHIP(line)].device);
+		return -EINVAL;
+	}
+	if (GPI(line)->type != GPI_NOTSET) {
+		ERR("Channel %d is already in use: %d.", PIN_LINE(line), GPI(line)->type);
+		return -EBUSY;
+	}
+	if (hysteresis < 0 || decimate < 1) {
+		ERR("Invalid hysteresis %d or decimation %d.", hysteresis, decimate);
+		return -EINVAL;
+	}
+	GPI(line)->type = GPI_ANALOG;
+	GPI(line)->ts_last = NEVER;
+	GPI(line)->ts_delta = 0;
+	GPI(line)->ctl = ctl;
+	// in ADC counts for now, we scale it when we know the resolution:
+	GPI(line)->hysteresis = hysteresis;
+	GPI(line)->decimate = decimate;
+	GPI(line)->an_last = -1;
+	chips[PIN_CHIP(line)].num_requested++;
+	return 0;
+}
+
+int setup_GPIOD_poll(int index, int rate)
+{
+	DBG("Polling GPIOD chip %d at %d Hz.", index, rate);
+	if (index < 0 || index >= MAXCHIP || chips[index].chip == NULL || chips[index].matrix) {
+		ERR("Chip %d has not been set up.", index);
+		return -EINVAL;
+	}
+	if (rate < 1 || rate > 1000000) {
+		ERR("Invalid poll rate %d Hz.", rate);
+		return -EINVAL;
+	}
+	chips[index].poll_rate = rate;
 	return 0;
 }
 
-int setup_GPIOD(char *dev, char *cons, void (*callback))
+int setup_GPIOD(char *cons, void (*callback))
 {
 	DBG("Setting up GPIOD.");
 	strncpy(consumer, cons, MAXNAME);
-	strncpy(device, dev, MAXNAME);
 	user_callback = callback;
 	return 0;
 }
 
+int setup_GPIOD_chip(int index, char *dev)
+{
+	chip_t *ch;
+	struct gpiod_chip_info *info;
 
-int start_GPIOD()
+	DBG("Setting up GPIOD chip %d (%s).", index, dev);
+	if (index < 0 || index >= MAXCHIP) {
+		ERR("Chip index %d out of range.", index);
+		return -EINVAL;
+	}
+	ch = &chips[index];
+	// libgpiod v2 wants a path, but we also accept bare chip names:
+	if (dev[0] == '/') {
+		strncpy(ch->device, dev, MAXNAME - 1);
+	} else {
+		snprintf(ch->device, MAXNAME, "/dev/%s", dev);
+	}
+	errno = 0;
+	ch->chip = gpiod_chip_open(ch->device);
+	if (ch->chip == NULL) {
+		ERR("gpiod_chip_open(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -ENODEV;
+	}
+	info = gpiod_chip_get_info(ch->chip);
+	if (info == NULL) {
+		ERR("gpiod_chip_get_info(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -ENODEV;
+	}
+	ch->num_lines = gpiod_chip_info_get_num_lines(info);
+	gpiod_chip_info_free(info);
+	// the line table is sized by the hardware, not by a compile-time limit:
+	ch->lines = calloc(sizeof(line_t), ch->num_lines);
+	if (ch->lines == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static struct gpiod_line_request *request_lines(int index, int debounce)
+{
+	chip_t *ch = &chips[index];
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *line_cfg;
+	struct gpiod_request_config *req_cfg;
+	struct gpiod_line_request *req = NULL;
+
+	settings = gpiod_line_settings_new();
+	line_cfg = gpiod_line_config_new();
+	req_cfg = gpiod_request_config_new();
+	if (settings == NULL || line_cfg == NULL || req_cfg == NULL) {
+		ERR("Could not allocate libgpiod configuration.");
+		goto cleanup;
+	}
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+	// polled chips can't do edge detection, that's why we poll them:
+	gpiod_line_settings_set_edge_detection(settings,
+		ch->poll_rate ? GPIOD_LINE_EDGE_NONE : GPIOD_LINE_EDGE_BOTH);
+	// all chips must stamp their events with the same clock, or we
+	// can't merge them:
+	gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+	for (int i = 0; i < ch->num_requested; i++) {
+		// settings are copied into the line config,
+		// so we can reuse them for every line:
+		// lines with adaptive debouncing must see their bounces,
+		// so we never let the kernel filter them:
+		gpiod_line_settings_set_debounce_period_us(settings,
+			(debounce && !ch->lines[ch->offsets[i]].db_max) ? ch->lines[ch->offsets[i]].ts_delta : 0);
+		if (gpiod_line_config_add_line_settings(line_cfg, &ch->offsets[i], 1, settings)) {
+			ERR("Could not configure line %d:%d.", index, ch->offsets[i]);
+			goto cleanup;
+		}
+	}
+	gpiod_request_config_set_consumer(req_cfg, consumer);
+	gpiod_request_config_set_event_buffer_size(req_cfg, GPI_EVENT_BUFSIZE);
+	req = gpiod_chip_request_lines(ch->chip, req_cfg, line_cfg);
+ cleanup:
+	if (req_cfg != NULL)
+		gpiod_request_config_free(req_cfg);
+	if (line_cfg != NULL)
+		gpiod_line_config_free(line_cfg);
+	if (settings != NULL)
+		gpiod_line_settings_free(settings);
+	return req;
+}
+
+static void check_debounce(int index)
+{
+	chip_t *ch = &chips[index];
+	struct gpiod_line_info *info;
+	unsigned long period;
+	line_t *l;
+
+	// if the kernel has accepted our debounce period, we can skip the
+	// userspace filter in handle_event(). if not, it stays in place.
+	for (int i = 0; i < ch->num_requested; i++) {
+		l = &ch->lines[ch->offsets[i]];
+		info = gpiod_chip_get_line_info(ch->chip, ch->offsets[i]);
+		if (info == NULL)
+			continue;
+		period = gpiod_line_info_get_debounce_period_us(info);
+		gpiod_line_info_free(info);
+		if (period != 0 && period >= l->ts_delta) {
+			DBG("Line %d:%d is debounced by the kernel (%lu us).", index, ch->offsets[i], period);
+			l->ts_delta = 0;
+		} else {
+			DBG("Line %d:%d is debounced in userspace (%d us).", index, ch->offsets[i], l->ts_delta);
+		}
+	}
+}
+
+static int request_fd(chip_t *ch)
+{
+	return (ch->request != NULL) ? gpiod_line_request_get_fd(ch->request) : ch->reqfd;
+}
+
+static int read_values(chip_t *ch, enum gpiod_line_value *values)
+{
+	struct gpio_v2_line_values v;
+
+	if (ch->request != NULL)
+		return gpiod_line_request_get_values(ch->request, values);
+	// an inherited request has our lines in the same order, and the
+	// kernel never gives out more than 64 per request:
+	v.bits = 0;
+	v.mask = (ch->num_requested < 64) ? (1ULL << ch->num_requested) - 1 : ~0ULL;
+	if (ioctl(ch->reqfd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v))
+		return -1;
+	for (int i = 0; i < ch->num_requested; i++) {
+		values[i] = ((v.bits >> i) & 1) ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE;
+	}
+	return 0;
+}
+
+static void init_rotaries(int index)
+{
+	chip_t *ch = &chips[index];
+	enum gpiod_line_value values[GPIO_V2_LINES_MAX];
+	line_t *l;
+
+	// start the decoders from where the rotaries actually are,
+	// otherwise the first detent might go the wrong way:
+	if (ch->num_requested > GPIO_V2_LINES_MAX || read_values(ch, values))
+		return;
+	for (int i = 0; i < ch->num_requested; i++) {
+		l = &ch->lines[ch->offsets[i]];
+		if (l->type != GPI_ROTARY && l->type != GPI_AUX)
+			continue;
+		if (values[i] != GPIOD_LINE_VALUE_ACTIVE)
+			continue;
+		if (l->type == GPI_ROTARY) {
+			l->state |= CLK;
+		} else {
+			GPI(l->aux)->state |= DT;
+		}
+	}
+}
+
+// a rotary decoder in one int, for the handover:
+#define DECODER(l) ((l)->state | ((l)->count & 0xff) << 8)
+#define DECODER_STATE(d) ((d) & 0xff)
+#define DECODER_COUNT(d) ((signed char)(((d) >> 8) & 0xff))
+
+static void restore_rotaries(int index, int *decoders)
+{
+	chip_t *ch = &chips[index];
+	line_t *l;
+
+	// the levels now are those after the edges that are still queued,
+	// so carry on from where our predecessor's decoders were instead:
+	for (int i = 0; i < ch->num_requested; i++) {
+		l = &ch->lines[ch->offsets[i]];
+		if (l->type != GPI_ROTARY)
+			continue;
+		l->state = DECODER_STATE(decoders[i]);
+		l->count = DECODER_COUNT(decoders[i]);
+	}
+}
+
+static int start_timer(int index)
+{
+	chip_t *ch = &chips[index];
+	struct itimerspec period = { 0 };
+	long ns = 1000000000L / ch->poll_rate;
+	int err;
+
+	ch->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ch->timerfd < 0) {
+		ERR("timerfd_create(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	period.it_interval.tv_sec = ns / 1000000000L;
+	period.it_interval.tv_nsec = ns % 1000000000L;
+	period.it_value = period.it_interval;
+	if (timerfd_settime(ch->timerfd, 0, &period, NULL)) {
+		ERR("timerfd_settime(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	err = eventloop_add(ch->timerfd, &chip_ready, ch);
+	if (err)
+		return err;
+	DBG("Polling %s every %ld ns.", ch->device, ns);
+	return 0;
+}
+
+static int start_polling(int index)
 {
+	chip_t *ch = &chips[index];
+
+	ch->snapshot = calloc(sizeof(enum gpiod_line_value), ch->num_requested);
+	ch->values = calloc(sizeof(enum gpiod_line_value), ch->num_requested);
+	if (ch->snapshot == NULL || ch->values == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	if (read_values(ch, ch->snapshot)) {
+		ERR("gpiod_line_request_get_values(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	return start_timer(index);
+}
+
+static int start_matrix(int index)
+{
+	chip_t *ch = &chips[index];
+	scan_t *s = ch->matrix;
+	chip_t *host = &chips[s->host];
+	struct gpiod_line_settings *settings;
+	struct gpiod_line_config *line_cfg;
+	struct gpiod_request_config *req_cfg;
+	int err = -ENOMEM;
+
+	settings = gpiod_line_settings_new();
+	line_cfg = gpiod_line_config_new();
+	req_cfg = gpiod_request_config_new();
+	if (settings == NULL || line_cfg == NULL || req_cfg == NULL) {
+		ERR("Could not allocate libgpiod configuration.");
+		goto cleanup;
+	}
+	// rows are open-drain, so two keys pressed in the same column
+	// can't short a driven row against a released one:
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+	gpiod_line_settings_set_drive(settings, GPIOD_LINE_DRIVE_OPEN_DRAIN);
+	for (unsigned int i = 0; i < s->nrows; i++) {
+		gpiod_line_settings_set_output_value(settings, s->out[i]);
+		if (gpiod_line_config_add_line_settings(line_cfg, &s->offsets[i], 1, settings))
+			goto cleanup;
+	}
+	gpiod_line_settings_reset(settings);
+	gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+	gpiod_line_settings_set_bias(settings, GPIOD_LINE_BIAS_PULL_UP);
+	if (gpiod_line_config_add_line_settings(line_cfg, &s->offsets[s->nrows], s->ncols, settings))
+		goto cleanup;
+	gpiod_request_config_set_consumer(req_cfg, consumer);
+	errno = 0;
+	s->request = gpiod_chip_request_lines(host->chip, req_cfg, line_cfg);
+	if (s->request == NULL) {
+		ERR("gpiod_chip_request_lines(%s for %s): errno = %d (%s).",
+		    host->device, ch->device, errno, strerror(errno));
+		err = -errno;
+		goto cleanup;
+	}
+	err = start_timer(index);
+ cleanup:
+	if (req_cfg != NULL)
+		gpiod_request_config_free(req_cfg);
+	if (line_cfg != NULL)
+		gpiod_line_config_free(line_cfg);
+	if (settings != NULL)
+		gpiod_line_settings_free(settings);
+	return err;
+}
+
+static int start_evdev(int index)
+{
+	chip_t *ch = &chips[index];
+	int fd, err;
+
+	// our predecessor's fd still holds the grab and all unread events:
+	fd = adopt_HANDOVER(ch->device, NULL, 0, 0, NULL);
+	if (fd < -1)
+		return fd;
+	if (fd >= 0) {
+		close(ch->evdev);
+		ch->evdev = fd;
+	}
+	err = eventloop_add(ch->evdev, &chip_ready, ch);
+	if (err)
+		return err;
+	return 0;
+}
+
+static int sysfs_write(char *dir, char *file, char *value)
+{
+	char path[PATH_MAX];
+	FILE *f;
 	int err = 0;
-	DBG("Starting GPIOD handler.");
-	for (int line = 0; line < MAXGPIO; line++) {
-		if (gpi[line] != NULL) {
-			offsets[num_lines++] = line;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, file);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		ERR("fopen(%s): errno = %d (%s).", path, errno, strerror(errno));
+		return -errno;
+	}
+	if (fputs(value, f) < 0)
+		err = -errno;
+	// sysfs reports errors on close:
+	if (fclose(f))
+		err = -errno;
+	if (err)
+		ERR("Writing %s to %s failed: errno = %d (%s).", value, path, -err, strerror(-err));
+	return err;
+}
+
+static int sysfs_read(char *dir, char *file, char *value, int len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		ERR("fopen(%s): errno = %d (%s).", path, errno, strerror(errno));
+		return -errno;
+	}
+	if (fgets(value, len, f) == NULL) {
+		fclose(f);
+		ERR("Could not read %s.", path);
+		return -EIO;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int setup_iio_channels(int index)
+{
+	chip_t *ch = &chips[index];
+	iio_t *d = ch->iio;
+	char dir[PATH_MAX];
+	char file[MAXNAME];
+	char value[MAXNAME];
+	char endian, sign;
+	iio_chan_t c;
+	DIR *scan;
+	struct dirent *e;
+	int j, len;
+
+	// a triggered buffer without a trigger can't be enabled, or never
+	// fills. we don't pick one, that is up to whoever set up the ADC:
+	snprintf(dir, PATH_MAX, "%s/trigger", d->sysfs);
+	if (access(dir, F_OK) == 0) {
+		if (sysfs_read(dir, "current_trigger", value, MAXNAME))
+			return -EINVAL;
+		if (value[0] == '\n' || value[0] == '\0') {
+			ERR("%s has no trigger, set one in %s/current_trigger first.", ch->device, dir);
+			return -ENODEV;
 		}
 	}
+	snprintf(dir, PATH_MAX, "%s/scan_elements", d->sysfs);
+	// the buffer must be off while we change its layout:
+	sysfs_write(d->sysfs, "buffer/enable", "0");
+	// we own the buffer, so switch off everything we don't need:
+	scan = opendir(dir);
+	if (scan == NULL) {
+		ERR("%s has no triggered buffer.", ch->device);
+		return -ENODEV;
+	}
+	while ((e = readdir(scan)) != NULL) {
+		len = strlen(e->d_name);
+		if (len > 3 && strcmp(e->d_name + len - 3, "_en") == 0)
+			sysfs_write(dir, e->d_name, "0");
+	}
+	closedir(scan);
+	for (int i = 0; i < ch->num_requested; i++) {
+		memset(&c, 0, sizeof(c));
+		c.line = ch->offsets[i];
+		snprintf(file, MAXNAME, "in_voltage%d_en", c.line);
+		if (sysfs_write(dir, file, "1"))
+			return -EINVAL;
+		snprintf(file, MAXNAME, "in_voltage%d_index", c.line);
+		if (sysfs_read(dir, file, value, MAXNAME))
+			return -EINVAL;
+		c.index = atoi(value);
+		// like "le:s12/16>>4":
+		snprintf(file, MAXNAME, "in_voltage%d_type", c.line);
+		if (sysfs_read(dir, file, value, MAXNAME))
+			return -EINVAL;
+		if (sscanf(value, "%ce:%c%u/%u>>%u", &endian, &sign, &c.bits, &c.bytes, &c.shift) != 5
+		    || c.bits < 1 || c.bits > 32 || (c.bytes != 8 && c.bytes != 16 && c.bytes != 32)) {
+			ERR("Can't handle channel %d of %s: %s", c.line, ch->device, value);
+			return -EINVAL;
+		}
+		c.bytes /= 8;
+		c.big_endian = (endian == 'b');
+		c.is_signed = (sign == 's');
+		// keep them in scan order:
+		for (j = i; j > 0 && d->chan[j - 1].index > c.index; j--) {
+			d->chan[j] = d->chan[j - 1];
+		}
+		d->chan[j] = c;
+	}
+	return sysfs_write(d->sysfs, "buffer/enable", "1");
+}
+
+static int start_iio(int index)
+{
+	chip_t *ch = &chips[index];
+	iio_t *d = ch->iio;
+	unsigned int align = 1;
+	line_t *l;
+	int err;
+
+	d->nchan = ch->num_requested;
+	d->chan = calloc(sizeof(iio_chan_t), d->nchan);
+	if (d->chan == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	if (d->standin) {
+		// native 16 bit unsigned samples, in channel order:
+		for (int i = 0; i < d->nchan; i++) {
+			d->chan[i].line = ch->offsets[i];
+			d->chan[i].bytes = 2;
+			d->chan[i].bits = 16;
+		}
+	} else {
+		err = setup_iio_channels(index);
+		if (err)
+			return err;
+	}
+	// each sample is aligned to its own size, and so is the scan:
+	for (int i = 0; i < d->nchan; i++) {
+		d->scan_bytes = (d->scan_bytes + d->chan[i].bytes - 1) / d->chan[i].bytes * d->chan[i].bytes;
+		d->chan[i].offset = d->scan_bytes;
+		d->scan_bytes += d->chan[i].bytes;
+		if (d->chan[i].bytes > align)
+			align = d->chan[i].bytes;
+		// scale the hysteresis to the 16 bits we report:
+		l = &ch->lines[d->chan[i].line];
+		if (d->chan[i].bits < 16)
+			l->hysteresis <<= 16 - d->chan[i].bits;
+		else
+			l->hysteresis >>= d->chan[i].bits - 16;
+	}
+	d->scan_bytes = (d->scan_bytes + align - 1) / align * align;
+	d->buf = calloc(d->scan_bytes, GPI_EVENT_BUFSIZE);
+	if (d->buf == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	DBG("%s: %d channels, %d bytes per scan.", ch->device, d->nchan, d->scan_bytes);
+	ch->iiofd = open(ch->device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (ch->iiofd < 0) {
+		ERR("open(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	err = eventloop_add(ch->iiofd, &chip_ready, ch);
+	if (err)
+		return err;
+	return 0;
+}
+
+static int start_chip(int index)
+{
+	chip_t *ch = &chips[index];
+	int decoders[GPIO_V2_LINES_MAX];
+	int n = 0;
+	int err;
+
+	ch->offsets = calloc(sizeof(unsigned int), ch->num_requested);
+	if (ch->offsets == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	for (unsigned int line = 0; line < ch->num_lines; line++) {
+		// matrix lines are requested by their matrix:
+		if (ch->lines[line].type != GPI_NOTSET && ch->lines[line].type != GPI_MATRIX)
+			ch->offsets[n++] = line;
+	}
+	if (ch->matrix)
+		return start_matrix(index);
+	if (ch->evdev)
+		return start_evdev(index);
+	if (ch->iio)
+		return start_iio(index);
+	// lines we inherit have been configured by our predecessor,
+	// and any edges it hasn't read are still queued on them:
+	ch->reqfd = adopt_HANDOVER(ch->device, ch->offsets, ch->num_requested, ch->poll_rate != 0, decoders);
+	if (ch->reqfd < -1)
+		return ch->reqfd;
+	if (ch->reqfd >= 0) {
+		DBG("Inherited the lines of %s.", ch->device);
+		check_debounce(index);
+		if (ch->poll_rate)
+			goto requested; // nothing queued, the levels are current
+		restore_rotaries(index, decoders);
+		goto started;
+	}
 	errno = 0;
-	if (num_lines == 0) {
-		DBG("No GPIO pins configured, skipping gpiod event handler.");
-		return 0;
+	ch->request = ch->poll_rate ? NULL : request_lines(index, 1);
+	if (ch->request == NULL && ch->poll_rate) {
+		ch->request = request_lines(index, 0);
+	} else if (ch->request == NULL) {
+		DBG("Kernel debouncing not available on %s (%s), falling back to userspace.",
+		    ch->device, strerror(errno));
+		ch->request = request_lines(index, 0);
+	} else {
+		check_debounce(index);
+	}
+	if (ch->request == NULL) {
+		ERR("gpiod_chip_request_lines(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		if (!ch->poll_rate)
+			ERR("If %s can't detect edges, try polling it with -P.", ch->device);
+		return -errno;
+	}
+ requested:
+	init_rotaries(index);
+	if (ch->poll_rate)
+		return start_polling(index);
+ started:
+	err = eventloop_add(request_fd(ch), &chip_ready, ch);
+	if (err)
+		return err;
+	return 0;
+}
+
+static void stop_chip(int index)
+{
+	chip_t *ch = &chips[index];
+
+	if (ch->poll_rate && ch->timerfd > 0)
+		close(ch->timerfd);
+	if (ch->evdev > 0) {
+		close(ch->evdev);
+		ch->evdev = 0;
+	}
+	if (ch->iio) {
+		if (ch->iiofd > 0)
+			close(ch->iiofd);
+		if (!ch->iio->standin && ch->iio->chan != NULL)
+			sysfs_write(ch->iio->sysfs, "buffer/enable", "0");
+		free(ch->iio->chan);
+		free(ch->iio->buf);
+		free(ch->iio);
+		ch->iio = NULL;
+	}
+	if (ch->matrix) {
+		if (ch->matrix->request != NULL)
+			gpiod_line_request_release(ch->matrix->request);
+		free(ch->matrix->offsets);
+		free(ch->matrix->out);
+		free(ch->matrix->in);
+		free(ch->matrix->raw);
+		free(ch->matrix->stable);
+		free(ch->matrix);
+		ch->matrix = NULL;
+	}
+	free(ch->snapshot);
+	free(ch->values);
+	ch->snapshot = NULL;
+	ch->values = NULL;
+	if (ch->request != NULL)
+		gpiod_line_request_release(ch->request);
+	if (ch->reqfd > 0)
+		close(ch->reqfd);
+	if (ch->chip != NULL)
+		gpiod_chip_close(ch->chip);
+	for (unsigned int i = 0; ch->lines != NULL && i < ch->num_lines; i++) {
+		free(ch->lines[i].gesture);
+	}
+	free(ch->offsets);
+	free(ch->lines);
+	ch->request = NULL;
+	ch->reqfd = 0;
+	ch->chip = NULL;
+	ch->offsets = NULL;
+	ch->lines = NULL;
+}
+
+static int queue_event(gpi_event_t *e, int count)
+{
+	int j;
+
+	// insertion sort by timestamp. this merges the events
+	// of all chips, and puts kernel-debounced edges back in
+	// order. they are never far off, so this is cheap:
+	for (j = count; j > 0 && batch[j - 1].ts > e->ts; j--) {
+		batch[j] = batch[j - 1];
+	}
+	batch[j] = *e;
+	return count + 1;
+}
+
+static int poll_chip(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	uint64_t ticks;
+	gpi_event_t e;
+
+	if (read(ch->timerfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return count; // spurious wakeup
+	if (ticks > 1)
+		ch->overruns += ticks - 1;
+	// one read for all lines of the chip, however many there are:
+	if (read_values(ch, ch->values)) {
+		ERR("gpiod_line_request_get_values(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	// we don't know when exactly between two ticks an edge happened,
+	// so we stamp it with the time we saw it:
+	e.ts = usec_now();
+	for (int i = 0; i < ch->num_requested && count < GPI_BATCHSIZE; i++) {
+		if (ch->values[i] == ch->snapshot[i])
+			continue;
+		e.line = PIN(index, ch->offsets[i]);
+		e.value = (ch->values[i] == GPIOD_LINE_VALUE_ACTIVE) ? 1 : 0;
+		count = queue_event(&e, count);
+		// lines we had no room for keep their old level, so that
+		// the next tick sees them change:
+		ch->snapshot[i] = ch->values[i];
+	}
+	return count;
+}
+
+static int scan_matrix(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	scan_t *s = ch->matrix;
+	uint64_t ticks;
+	gpi_event_t e;
+	unsigned int key;
+	unsigned char level;
+
+	if (read(ch->timerfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return count; // spurious wakeup
+	if (ticks > 1)
+		ch->overruns += ticks - 1;
+	// the current row has been driven since the last tick, so the
+	// columns have had a whole step to settle:
+	if (gpiod_line_request_get_values_subset(s->request, s->ncols, &s->offsets[s->nrows], s->in)) {
+		ERR("gpiod_line_request_get_values_subset(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	e.ts = usec_now();
+	for (unsigned int c = 0; c < s->ncols && count < GPI_BATCHSIZE; c++) {
+		key = s->row * s->ncols + c;
+		level = (s->in[c] == GPIOD_LINE_VALUE_ACTIVE) ? 1 : 0;
+		// a key must read the same on two scans in a row before
+		// we believe it. this debounces it by one scan period:
+		if (level == s->raw[key] && level != s->stable[key]) {
+			s->stable[key] = level;
+			if (ch->lines[key].type != GPI_NOTSET) {
+				e.line = PIN(index, key);
+				e.value = level;
+				count = queue_event(&e, count);
+			}
+		}
+		s->raw[key] = level;
+	}
+	// release this row and drive the next one:
+	s->out[s->row] = GPIOD_LINE_VALUE_ACTIVE;
+	s->row = (s->row + 1) % s->nrows;
+	s->out[s->row] = GPIOD_LINE_VALUE_INACTIVE;
+	if (gpiod_line_request_set_values_subset(s->request, s->nrows, s->offsets, s->out)) {
+		ERR("gpiod_line_request_set_values_subset(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	return count;
+}
+
+static int read_evdev(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	struct input_event ev[GPI_EVENT_BUFSIZE];
+	gpi_event_t e;
+	ssize_t n;
+	int space;
+	unsigned int line;
+
+	// like the gpio chips, read as many events as we can get in one go:
+	do {
+		space = GPI_BATCHSIZE - count;
+		if (space > GPI_EVENT_BUFSIZE)
+			space = GPI_EVENT_BUFSIZE;
+		n = read(ch->evdev, ev, space * sizeof(struct input_event));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return count;
+			ERR("read(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+			return -errno;
+		}
+		n /= sizeof(struct input_event);
+		for (int i = 0; i < n; i++) {
+			switch (ev[i].type) {
+			case EV_KEY:
+				// 2 is autorepeat, which we don't want:
+				if (ev[i].code >= EVDEV_KEYS || ev[i].value == 2)
+					continue;
+				line = EVDEV_KEY_LINE(ev[i].code);
+				// pressed keys look like a line pulled to ground:
+				e.value = !ev[i].value;
+				break;
+			case EV_REL:
+				if (ev[i].code >= EVDEV_RELS)
+					continue;
+				line = EVDEV_REL_LINE(ev[i].code);
+				e.value = ev[i].value;
+				break;
+			case EV_SYN:
+				if (ev[i].code == SYN_DROPPED)
+					ch->dropped++;
+				continue;
+			default:
+				continue;
+			}
+			if (ch->lines[line].type == GPI_NOTSET)
+				continue;
+			e.line = PIN(index, line);
+			e.ts = ev[i].input_event_sec * 1000000ULL + ev[i].input_event_usec;
+			count = queue_event(&e, count);
+		}
+	} while (n == space && count < GPI_BATCHSIZE);
+	return count;
+}
+
+static int iio_sample(iio_chan_t *c, unsigned char *p)
+{
+	unsigned long long raw = 0;
+	long long v;
+
+	for (unsigned int i = 0; i < c->bytes; i++) {
+		raw |= (unsigned long long)p[c->big_endian ? i : c->bytes - 1 - i] << (8 * (c->bytes - 1 - i));
+	}
+	raw >>= c->shift;
+	raw &= (1ULL << c->bits) - 1;
+	// move signed samples up, so that we always count from 0:
+	v = (long long)raw;
+	if (c->is_signed)
+		v ^= 1LL << (c->bits - 1);
+	if (c->bits < 16)
+		return v << (16 - c->bits);
+	return v >> (c->bits - 16);
+}
+
+static int read_iio(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	iio_t *d = ch->iio;
+	line_t *l;
+	gpi_event_t e;
+	ssize_t n;
+	unsigned char *scan;
+	int avg;
+
+	n = read(ch->iiofd, d->buf + d->fill, d->scan_bytes * GPI_EVENT_BUFSIZE - d->fill);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return count;
+		ERR("read(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+		return -errno;
+	}
+	d->fill += n;
+	e.ts = usec_now();
+	for (scan = d->buf; scan + d->scan_bytes <= d->buf + d->fill; scan += d->scan_bytes) {
+		for (int i = 0; i < d->nchan; i++) {
+			l = &ch->lines[d->chan[i].line];
+			l->an_sum += iio_sample(&d->chan[i], scan + d->chan[i].offset);
+			if (++l->an_count < l->decimate)
+				continue;
+			avg = l->an_sum / l->an_count;
+			l->an_sum = 0;
+			l->an_count = 0;
+			// only tell anyone if it moved by more than the noise:
+			if (l->an_last >= 0 && abs(avg - l->an_last) <= l->hysteresis)
+				continue;
+			if (count >= GPI_BATCHSIZE)
+				continue; // try again with the next average
+			l->an_last = avg;
+			e.line = PIN(index, d->chan[i].line);
+			e.value = avg;
+			count = queue_event(&e, count);
+		}
 	}
-	err = gpiod_ctxless_event_loop_multiple(device, offsets, num_lines,
-						ACTIVE_HIGH, consumer, FOREVER,
-						NULL, &handle_event, NULL);
-	if (err != 0) {
-		ERR("gpiod_ctxless_event_loop_multple: err = %d, errno = %d (%s).", err,
-		    errno, strerror(errno));
+	// a stand-in fifo can hand us partial scans:
+	d->fill -= scan - d->buf;
+	memmove(d->buf, scan, d->fill);
+	return count;
+}
+
+static int read_inherited(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	struct pollfd pfd = { .fd = ch->reqfd, .events = POLLIN };
+	gpi_event_t e;
+	ssize_t n;
+	int space;
+
+	// the same as below, but straight from the kernel:
+	do {
+		space = GPI_BATCHSIZE - count;
+		if (space > GPI_EVENT_BUFSIZE)
+			space = GPI_EVENT_BUFSIZE;
+		n = read(ch->reqfd, raw_events, space * sizeof(struct gpio_v2_line_event));
+		if (n < 0) {
+			if (errno == EAGAIN)
+				return count;
+			ERR("read(%s): errno = %d (%s).", ch->device, errno, strerror(errno));
+			return -errno;
+		}
+		n /= sizeof(struct gpio_v2_line_event);
+		for (int i = 0; i < n; i++) {
+			e.line = PIN(index, raw_events[i].offset);
+			e.ts = usec_stamp(raw_events[i].timestamp_ns);
+			e.value = (raw_events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE) ? 1 : 0;
+			count = queue_event(&e, count);
+		}
+	} while (n == GPI_EVENT_BUFSIZE && count < GPI_BATCHSIZE
+		 && poll(&pfd, 1, 0) > 0);
+	return count;
+}
+
+static int read_chip(int index, int count)
+{
+	chip_t *ch = &chips[index];
+	struct gpiod_edge_event *event;
+	gpi_event_t e;
+	int n, space;
+
+	if (ch->matrix)
+		return scan_matrix(index, count);
+	if (ch->evdev)
+		return read_evdev(index, count);
+	if (ch->iio)
+		return read_iio(index, count);
+	if (ch->poll_rate)
+		return poll_chip(index, count);
+	if (ch->request == NULL)
+		return read_inherited(index, count);
+
+	// drain as many events as the kernel has queued for us, so that a
+	// fast spin costs one wakeup instead of one wakeup per edge.
+	do {
+		space = GPI_BATCHSIZE - count;
+		if (space > GPI_EVENT_BUFSIZE)
+			space = GPI_EVENT_BUFSIZE;
+		n = gpiod_line_request_read_edge_events(ch->request, event_buffer, space);
+		if (n < 0) {
+			ERR("gpiod_line_request_read_edge_events(%s): errno = %d (%s).",
+			    ch->device, errno, strerror(errno));
+			return n;
+		}
+		for (int i = 0; i < n; i++) {
+			event = gpiod_edge_event_buffer_get_event(event_buffer, i);
+			e.line = PIN(index, gpiod_edge_event_get_line_offset(event));
+			e.ts = usec_stamp(gpiod_edge_event_get_timestamp_ns(event));
+			e.value = (gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE) ? 1 : 0;
+			count = queue_event(&e, count);
+		}
+		// only read again if the last read filled the buffer and
+		// more events are pending, otherwise read() would block:
+	} while (n == GPI_EVENT_BUFSIZE && count < GPI_BATCHSIZE
+		 && gpiod_line_request_wait_edge_events(ch->request, 0) > 0);
+	return count;
+}
+
+static void chip_ready(void *data)
+{
+	int index = (chip_t *)data - chips;
+	int n;
+
+	// events of all chips that are ready pile up in one batch,
+	// which is dispatched once they have all been read. when it is
+	// full, this chip stays ready and we are back after dispatch:
+	if (nbatch >= GPI_BATCHSIZE)
+		return;
+	n = read_chip(index, nbatch);
+	if (n < 0) {
+		stop_eventloop(n);
+		return;
+	}
+	nbatch = n;
+}
+
+static int sampled(int index)
+{
+	// matrices and IIO devices are scanned, not interrupt-driven, so a
+	// late start doesn't lose any edges:
+	return chips[index].matrix != NULL || chips[index].iio != NULL;
+}
+
+static void dispatch_batch()
+{
+	unsigned long long now;
+	int index, kind;
+
+	if (nbatch == 0)
+		return;
+	DBG("Processing a batch of %d events.", nbatch);
+	now = usec_now();
+	for (int i = 0; i < nbatch; i++) {
+		index = PIN_CHIP(batch[i].line);
+		kind = (sampled(index) || chips[index].poll_rate) ? SAMPLES : EDGES;
+		account_latency(kind, batch[i].ts, now);
+		handle_event(batch[i].line, batch[i].value, batch[i].ts);
+	}
+	nbatch = 0;
+}
+
+int export_GPIOD(int index, char **device, unsigned int **offsets, int *n, int *polled, int *decoders)
+{
+	chip_t *ch = &chips[index];
+
+	*device = ch->device;
+	*offsets = ch->offsets;
+	*n = ch->num_requested;
+	*polled = (ch->poll_rate != 0);
+	for (int i = 0; i < ch->num_requested && i < GPIO_V2_LINES_MAX; i++) {
+		line_t *l = &ch->lines[ch->offsets[i]];
+
+		decoders[i] = (l->type == GPI_ROTARY) ? DECODER(l) : 0;
+	}
+	if (ch->evdev > 0) {
+		*n = 0;
+		return ch->evdev;
+	}
+	if (ch->num_requested == 0 || sampled(index))
+		return -1;
+	return request_fd(ch);
+}
+
+int start_GPIOD()
+{
+	int err = 0;
+
+	DBG("Starting GPIOD handler.");
+	// everything that can queue edges for us goes first, the rest is
+	// started by start_GPIOD_scanners():
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (chips[i].num_requested == 0 || sampled(i))
+			continue;
+		err = start_chip(i);
+		if (err)
+			return err;
+	}
+	err = build_chords();
+	if (err)
 		return err;
+	event_buffer = gpiod_edge_event_buffer_new(GPI_EVENT_BUFSIZE);
+	if (event_buffer == NULL) {
+		ERR("gpiod_edge_event_buffer_new: errno = %d (%s).", errno, strerror(errno));
+		return -ENOMEM;
+	}
+	return eventloop_after(&dispatch_batch);
+}
+
+int start_GPIOD_scanners()
+{
+	int err;
+
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (chips[i].num_requested == 0 || !sampled(i))
+			continue;
+		err = start_chip(i);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int shutdown_GPIOD()
+{
+	line_t *l;
+
+	DBG("Shutting down GPIOD.");
+	for (int i = 0; i < MAXCHIP; i++) {
+		for (int j = 0; j < chips[i].num_requested; j++) {
+			l = &chips[i].lines[chips[i].offsets[j]];
+			if (l->type == GPI_ROTARY && l->illegal)
+				NFO("Rotary on %d:%d saw %d illegal transitions.", i, chips[i].offsets[j], l->illegal);
+			if (l->db_max)
+				NFO("Line %d:%d settled on a debounce window of %d us.", i, chips[i].offsets[j], l->ts_delta);
+		}
+		if (chips[i].overruns)
+			NFO("Polling %s missed %llu ticks.", chips[i].device, chips[i].overruns);
+		if (chips[i].dropped)
+			NFO("%s dropped events %lu times.", chips[i].device, chips[i].dropped);
+	}
+	if (latency[EDGES].count)
+		NFO("Edge-to-dispatch latency (%s): min %llu us, avg %llu us, max %llu us over %lu events.",
+		    (busy_cpu < 0) ? "interrupt-driven" : "busy-poll",
+		    latency[EDGES].min, latency[EDGES].sum / latency[EDGES].count,
+		    latency[EDGES].max, latency[EDGES].count);
+	if (latency[SAMPLES].count)
+		NFO("Sample-to-dispatch latency (sampled): min %llu us, avg %llu us, max %llu us over %lu events.",
+		    latency[SAMPLES].min, latency[SAMPLES].sum / latency[SAMPLES].count,
+		    latency[SAMPLES].max, latency[SAMPLES].count);
+	// the event loop is done by now, so we can tear everything down:
+	for (int i = 0; i < MAXCHIP; i++) {
+		stop_chip(i);
 	}
+	if (event_buffer != NULL)
+		gpiod_edge_event_buffer_free(event_buffer);
+	event_buffer = NULL;
+	free(chord_table);
+	free(chords);
+	chord_table = NULL;
+	chords = NULL;
 	return 0;
 }
@@ -19,10 +19,24 @@
 #ifndef GPIOD_PROCESS_H
 #define GPIOD_PROCESS_H
 
-int setup_GPIOD_rotary(int clk, int dt);
-int setup_GPIOD_switch(int sw);
-int setup_GPIOD(char *dev, char *cons, void (*callback));
+#include "globals.h"
+
+int setup_GPIOD_rotary(int clk, int dt, int res, int ctl);
+int setup_GPIOD_accel(int clk, int max, int speed);
+int setup_GPIOD_debounce(int line, int min, int max);
+int setup_GPIOD_switch(int sw, int ctl);
+int setup_GPIOD_chord(unsigned int *pins, int n, int ctl);
+int setup_GPIOD_gesture(int line, int gesture, int ms, int ctl);
+int setup_GPIOD(char *cons, void (*callback));
+int setup_GPIOD_chip(int index, char *dev);
+int setup_GPIOD_poll(int index, int rate);
+int setup_GPIOD_matrix(int index, char *name, matrix_t *m);
+int setup_GPIOD_evdev(int index, char *dev);
+int setup_GPIOD_iio(int index, char *dev);
+int setup_GPIOD_analog(int line, int ctl, int hysteresis, int decimate);
 int start_GPIOD();
+int start_GPIOD_scanners();
+int export_GPIOD(int index, char **device, unsigned int **offsets, int *n, int *polled, int *decoders);
 int shutdown_GPIOD();
 
 #endif
@@ -0,0 +1,548 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _GNU_SOURCE // for accept4()
+#include "handover.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "globals.h"
+#include "gpiod_process.h"
+#include "eventloop.h"
+
+#ifdef HAVE_OSC
+#include "slave_process.h"
+#endif
+
+// the kernel never gives out more than 64 lines per request:
+#define HANDOVER_MAXDATA 64
+// how long either side waits for the other, in s:
+#define HANDOVER_TIMEOUT 10
+#define HANDOVER_TAKE 'T'
+#define HANDOVER_ACK 'A'
+
+typedef enum {
+	HANDOVER_CONTROLS,
+	HANDOVER_CHIP,
+	HANDOVER_SOCKET,
+	HANDOVER_VALUES,
+	HANDOVER_END
+} handover_kind_t;
+
+// what a controller's value belongs to:
+typedef struct {
+	int type;
+	int target;
+	int line;
+	char device[MAXNAME];
+} handover_control_t;
+
+// the handover has two rounds, each ending with HANDOVER_END. as soon
+// as a successor connects, it gets our controllers, in chunks, to check
+// that it has the same ones. we carry on as usual while it gets ready.
+// once it asks with HANDOVER_TAKE, we stop reading events, and send one
+// message per chip or socket, with its fd attached, then the controller
+// values in chunks. we use a SOCK_SEQPACKET socket, so each message
+// arrives in one piece:
+typedef struct {
+	handover_kind_t kind;
+	int n; // number of offsets, controllers or values
+	int polled; // chips: no edge detection
+	int first; // controllers, values: the controller of data[0]
+	int total; // controllers, values: the number of controllers
+	char device[MAXNAME];
+	int data[HANDOVER_MAXDATA];
+	// chips: the rotary decoders, line by line, so that the edges
+	// still queued carry on from where our predecessor left off:
+	int decoders[HANDOVER_MAXDATA];
+	handover_control_t controls[HANDOVER_MAXDATA];
+} handover_msg_t;
+
+typedef struct {
+	char device[MAXNAME];
+	int fd;
+	int polled;
+	int n;
+	unsigned int offsets[HANDOVER_MAXDATA];
+	int decoders[HANDOVER_MAXDATA];
+} inherited_t;
+
+static char *path = NULL;
+static int listener = -1;
+// the instance we are taking over from:
+static int peer = -1;
+static inherited_t inherited[MAXCHIP];
+static int ninherited = 0;
+static int inherited_socket = -1;
+// our controller for each of our predecessor's, and which are taken:
+static int *match = NULL;
+static char *matched = NULL;
+static int nmatched = 0;
+// the instance that is getting ready to take over from us:
+static int successor = -1;
+// and has asked for everything:
+static int requested = 0;
+
+static int send_msg(int sock, handover_msg_t *m, int fd)
+{
+	struct iovec iov = { .iov_base = m, .iov_len = sizeof(*m) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+
+	if (fd >= 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(*m)) {
+		ERR("sendmsg: errno = %d (%s).", errno, strerror(errno));
+		return -EIO;
+	}
+	return 0;
+}
+
+static int recv_msg(int sock, handover_msg_t *m, int *fd)
+{
+	struct iovec iov = { .iov_base = m, .iov_len = sizeof(*m) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	*fd = -1;
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (n > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	if (n != sizeof(*m)) {
+		ERR("recvmsg: errno = %d (%s).", errno, (n < 0) ? strerror(errno) : "short message");
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		return -EIO;
+	}
+	return 0;
+}
+
+static void timeout(int sock)
+{
+	struct timeval tv = { .tv_sec = HANDOVER_TIMEOUT };
+
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void describe(control_t *c, handover_control_t *d)
+{
+	char *device = gpio_chip[PIN_CHIP(c->pin1)];
+
+	memset(d, 0, sizeof(*d));
+	d->type = c->type;
+	d->target = c->target;
+	d->line = PIN_LINE(c->pin1);
+	if (device != NULL)
+		strncpy(d->device, device, MAXNAME - 1);
+}
+
+// pair each of our predecessor's controllers with the first of ours
+// that has the same input and target and isn't taken yet:
+static int match_controls(handover_msg_t *m)
+{
+	handover_control_t d;
+	int j;
+
+	if (m->total != ncontrollers) {
+		ERR("The new instance has %d controllers instead of %d.", ncontrollers, m->total);
+		return -EBUSY;
+	}
+	if (m->first < 0 || m->n < 0 || m->n > HANDOVER_MAXDATA || m->first + m->n > ncontrollers)
+		return -EPROTO;
+	if (match == NULL) {
+		match = calloc(ncontrollers, sizeof(int));
+		matched = calloc(ncontrollers, sizeof(char));
+		if (match == NULL || matched == NULL) {
+			ERR("calloc() failed.");
+			return -ENOMEM;
+		}
+	}
+	for (int k = 0; k < m->n; k++) {
+		for (j = 0; j < ncontrollers; j++) {
+			describe(&controller[j], &d);
+			if (!matched[j] && memcmp(&d, &m->controls[k], sizeof(d)) == 0)
+				break;
+		}
+		if (j == ncontrollers) {
+			ERR("Controller %d of the running instance, on %s:%d, has no counterpart here.",
+			    m->first + k + 1, m->controls[k].device, m->controls[k].line);
+			return -EBUSY;
+		}
+		matched[j] = 1;
+		match[m->first + k] = j;
+		nmatched++;
+	}
+	return 0;
+}
+
+static int inherit(handover_msg_t *m, int fd)
+{
+	inherited_t *i;
+
+	switch (m->kind) {
+	case HANDOVER_CONTROLS:
+		if (fd >= 0)
+			break;
+		return match_controls(m);
+	case HANDOVER_CHIP:
+		if (fd < 0 || ninherited == MAXCHIP || m->n < 0 || m->n > HANDOVER_MAXDATA)
+			break;
+		i = &inherited[ninherited++];
+		strncpy(i->device, m->device, MAXNAME - 1);
+		i->fd = fd;
+		i->polled = m->polled;
+		i->n = m->n;
+		memcpy(i->offsets, m->data, m->n * sizeof(int));
+		memcpy(i->decoders, m->decoders, m->n * sizeof(int));
+		DBG("Inherited %d lines of %s.", i->n, i->device);
+		return 0;
+	case HANDOVER_SOCKET:
+		if (fd < 0 || inherited_socket >= 0)
+			break;
+		inherited_socket = fd;
+		return 0;
+	case HANDOVER_VALUES:
+		// the controllers have been matched in the first round:
+		if (nmatched != ncontrollers || m->total != ncontrollers || fd >= 0
+		    || m->first < 0 || m->n < 0 || m->n > HANDOVER_MAXDATA || m->first + m->n > ncontrollers)
+			break;
+		for (int j = 0; j < m->n; j++) {
+			controller[match[m->first + j]].value = m->data[j];
+		}
+		return 0;
+	case HANDOVER_END:
+		return 0;
+	}
+	ERR("Bad handover message (type %d).", m->kind);
+	if (fd >= 0)
+		close(fd);
+	return -EPROTO;
+}
+
+// one round of messages, up to HANDOVER_END:
+static int receive()
+{
+	handover_msg_t m;
+	int fd, err;
+
+	do {
+		err = recv_msg(peer, &m, &fd);
+		if (err == 0)
+			err = inherit(&m, fd);
+		if (err) {
+			ERR("Could not take over from %s.", path);
+			return err;
+		}
+	} while (m.kind != HANDOVER_END);
+	return 0;
+}
+
+int setup_HANDOVER(char *p)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	DBG("Setting up HANDOVER at %s.", p);
+	if (strlen(p) >= sizeof(addr.sun_path)) {
+		ERR("Handover socket path %s is too long.", p);
+		return -ENAMETOOLONG;
+	}
+	path = p;
+	strcpy(addr.sun_path, path);
+	peer = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (peer < 0) {
+		ERR("socket: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	if (connect(peer, (struct sockaddr *)&addr, sizeof(addr))) {
+		// nobody to take over from, we start from scratch:
+		DBG("No running instance at %s (%s).", path, strerror(errno));
+		close(peer);
+		peer = -1;
+		return 0;
+	}
+	NFO("Taking over from the running instance at %s.", path);
+	timeout(peer);
+	// our predecessor carries on until take_HANDOVER(), this is only
+	// to make sure we have the same controllers:
+	return receive();
+}
+
+int take_HANDOVER()
+{
+	char take = HANDOVER_TAKE;
+
+	if (peer < 0)
+		return 0;
+	DBG("Taking over lines and values.");
+	if (send(peer, &take, 1, MSG_NOSIGNAL) != 1) {
+		ERR("Could not ask for the handover: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	// from here on, our predecessor doesn't read any more events,
+	// they queue up on the fds it sends us:
+	return receive();
+}
+
+int adopt_HANDOVER(char *device, unsigned int *offsets, int n, int polled, int *decoders)
+{
+	inherited_t *i;
+	int fd;
+
+	for (int j = 0; j < ninherited; j++) {
+		i = &inherited[j];
+		if (i->fd < 0 || strcmp(i->device, device))
+			continue;
+		// our predecessor has configured the lines, we can only use
+		// them as they are:
+		if (i->n != n || i->polled != polled
+		    || (n > 0 && memcmp(i->offsets, offsets, n * sizeof(int)))) {
+			ERR("The lines of %s have changed, can't take them over.", device);
+			return -EBUSY;
+		}
+		if (decoders != NULL)
+			memcpy(decoders, i->decoders, n * sizeof(int));
+		fd = i->fd;
+		i->fd = -1;
+		return fd;
+	}
+	return -1;
+}
+
+int adopt_HANDOVER_socket()
+{
+	int fd = inherited_socket;
+
+	inherited_socket = -1;
+	return fd;
+}
+
+static void drop_successor()
+{
+	eventloop_del(successor);
+	close(successor);
+	successor = -1;
+	requested = 0;
+	NFO("The new instance did not take over, carrying on.");
+}
+
+static void handle_successor(void *data __attribute__((unused)))
+{
+	// we hand over once all events of this wakeup have been
+	// dispatched, so that the values we send are current:
+	requested = 1;
+}
+
+static void handle_listener(void *data __attribute__((unused)))
+{
+	handover_msg_t m;
+	int sock;
+
+	sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0) {
+		ERR("accept4: errno = %d (%s).", errno, strerror(errno));
+		return;
+	}
+	// one at a time:
+	if (successor >= 0) {
+		close(sock);
+		return;
+	}
+	NFO("A new instance is getting ready to take over.");
+	timeout(sock);
+	successor = sock;
+	for (int i = 0; i < ncontrollers; i += HANDOVER_MAXDATA) {
+		memset(&m, 0, sizeof(m));
+		m.kind = HANDOVER_CONTROLS;
+		m.first = i;
+		m.total = ncontrollers;
+		m.n = (ncontrollers - i < HANDOVER_MAXDATA) ? ncontrollers - i : HANDOVER_MAXDATA;
+		for (int j = 0; j < m.n; j++) {
+			describe(&controller[i + j], &m.controls[j]);
+		}
+		if (send_msg(sock, &m, -1))
+			goto abort;
+	}
+	memset(&m, 0, sizeof(m));
+	m.kind = HANDOVER_END;
+	if (send_msg(sock, &m, -1))
+		goto abort;
+	// until it asks for the rest, or gives up:
+	if (eventloop_add(sock, &handle_successor, NULL) == 0)
+		return;
+ abort:
+	drop_successor();
+}
+
+static void handle_handover()
+{
+	handover_msg_t m;
+	char *device;
+	unsigned int *offsets;
+	int decoders[HANDOVER_MAXDATA];
+	int sock = successor, fd, n, polled;
+	char c = 0;
+
+	if (!requested)
+		return;
+	requested = 0;
+	// it has closed the socket if it gave up:
+	if (recv(sock, &c, 1, 0) != 1 || c != HANDOVER_TAKE)
+		goto abort;
+	NFO("Handing over to the new instance.");
+	// we don't read any edges while we're in here, so they stay queued
+	// for our successor:
+	for (int i = 0; i < MAXCHIP; i++) {
+		fd = export_GPIOD(i, &device, &offsets, &n, &polled, decoders);
+		if (fd < 0 || n > HANDOVER_MAXDATA)
+			continue;
+		memset(&m, 0, sizeof(m));
+		m.kind = HANDOVER_CHIP;
+		m.n = n;
+		m.polled = polled;
+		strncpy(m.device, device, MAXNAME - 1);
+		memcpy(m.data, offsets, n * sizeof(int));
+		memcpy(m.decoders, decoders, n * sizeof(int));
+		if (send_msg(sock, &m, fd))
+			goto abort;
+	}
+#ifdef HAVE_OSC
+	fd = use_slave ? get_SLAVE_fd() : -1;
+	if (fd >= 0) {
+		memset(&m, 0, sizeof(m));
+		m.kind = HANDOVER_SOCKET;
+		if (send_msg(sock, &m, fd))
+			goto abort;
+	}
+#endif
+	for (int i = 0; i < ncontrollers; i += HANDOVER_MAXDATA) {
+		memset(&m, 0, sizeof(m));
+		m.kind = HANDOVER_VALUES;
+		m.first = i;
+		m.total = ncontrollers;
+		m.n = (ncontrollers - i < HANDOVER_MAXDATA) ? ncontrollers - i : HANDOVER_MAXDATA;
+		for (int j = 0; j < m.n; j++) {
+			m.data[j] = controller[i + j].value;
+		}
+		if (send_msg(sock, &m, -1))
+			goto abort;
+	}
+	memset(&m, 0, sizeof(m));
+	m.kind = HANDOVER_END;
+	if (send_msg(sock, &m, -1))
+		goto abort;
+	if (recv(sock, &c, 1, 0) == 1 && c == HANDOVER_ACK) {
+		NFO("Handed over, terminating.");
+		// our successor knows we're gone when sock closes on exit:
+		eventloop_del(sock);
+		stop_eventloop(0);
+		return;
+	}
+ abort:
+	drop_successor();
+}
+
+int start_HANDOVER()
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char ack = HANDOVER_ACK;
+	char c;
+	int err;
+
+	if (path == NULL)
+		return 0;
+	DBG("Starting HANDOVER.");
+	free(match);
+	free(matched);
+	match = NULL;
+	matched = NULL;
+	if (peer >= 0) {
+		// whatever we haven't adopted, we don't need:
+		for (int i = 0; i < ninherited; i++) {
+			if (inherited[i].fd >= 0)
+				close(inherited[i].fd);
+		}
+		if (inherited_socket >= 0)
+			close(inherited_socket);
+		if (send(peer, &ack, 1, MSG_NOSIGNAL) != 1) {
+			ERR("Could not confirm the handover: errno = %d (%s).", errno, strerror(errno));
+			return -errno;
+		}
+		// wait for our predecessor to exit, so that the devices it
+		// did not hand over are free:
+		while (recv(peer, &c, 1, 0) > 0)
+			;
+		close(peer);
+		peer = -1;
+		NFO("Took over from the previous instance.");
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		ERR("socket: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 1)) {
+		err = -errno;
+		ERR("Could not listen on %s: errno = %d (%s).", path, errno, strerror(errno));
+		close(listener);
+		listener = -1;
+		return err;
+	}
+	err = eventloop_after(&handle_handover);
+	if (err)
+		return err;
+	return eventloop_add(listener, &handle_listener, NULL);
+}
+
+int shutdown_HANDOVER()
+{
+	DBG("Shutting down HANDOVER.");
+	if (listener < 0)
+		return 0;
+	if (successor >= 0)
+		close(successor);
+	close(listener);
+	// our successor, if any, only binds after we're gone:
+	unlink(path);
+	return 0;
+}
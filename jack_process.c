@@ -21,6 +21,7 @@
 #include <jack/jack.h>
 #include <jack/midiport.h>
 #include "ringbuffer.h"
+#include "jack_cmdline.h"
 #include "globals.h"
 
 jack_client_t *client;
@@ -44,6 +45,8 @@ static int process(jack_nframes_t nframes, void *arg)
 int setup_JACK()
 {
 	DBG("Setting up JACK.");
+	if (setup_ringbuffer(JACK_BUFSIZE))
+		return -ENOMEM;
 	if ((client =
 	     jack_client_open(PROGRAM_NAME, JackNoStartServer, NULL)) == 0) {
 		ERR("Failed to create client. Is the JACK server running?");
@@ -65,6 +68,7 @@ int shutdown_JACK()
 {
 	DBG("Shutting down JACK.");
 	jack_client_close(client);
+	shutdown_ringbuffer();
 	return 0;
 }
 
@@ -85,3 +89,17 @@ int update_JACK(control_t * c)
 	}
 	return 0;
 }
+
+output_t output_JACK = {
+	.abi = OUTPUT_ABI,
+	.name = "jack",
+	.help_rotary = &help_rotary_JACK,
+	.help_switch = &help_switch_JACK,
+	.parse_rotary = &parse_cmdline_rotary_JACK,
+	.parse_switch = &parse_cmdline_switch_JACK,
+	.setup = &setup_JACK,
+	.update = &update_JACK,
+	.shutdown = &shutdown_JACK,
+	// the ringbuffer never blocks, so no need for a worker
+	.blocking = 0
+};
@@ -20,6 +20,9 @@
 #define JACK_PROCESS_H
 
 #include "globals.h"
+#include "output.h"
+
+extern output_t output_JACK;
 
 int setup_JACK();
 int shutdown_JACK();
@@ -21,44 +21,60 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <string.h>
 #include <pthread.h>
+#include <sys/signalfd.h>
 
 #include "globals.h"
 #include "parse_cmdline.h"
 #include "gpiod_process.h"
 #include "build/config.h"
-#include "stdout_process.h"
-
-#ifdef HAVE_JACK
-#include "ringbuffer.h"
-#include "jack_process.h"
-#endif
+#include "handover.h"
+#include "eventloop.h"
+#include "output.h"
+#include "worker.h"
+#include "timerwheel.h"
 
 #ifdef HAVE_ALSA
 #include "alsa_process.h"
 #endif
 
 #ifdef HAVE_OSC
-#include "osc_process.h"
 #include "slave_process.h"
 #endif
 
-control_t *controller[NCONTROLLERS] = { 0 };
+control_t *controller = NULL;
+control_cfg_t *controller_cfg = NULL;
+int ncontrollers = 0;
 
 int verbose = 0;
-int use_alsa = 0;
-int use_jack = 0;
-int use_osc = 0;
-int use_stdout = 0;
+int busy_cpu = -1;
 int use_slave = 0;
 
 char* osc_url;
+// where a running instance waits to hand over to its successor:
+char* handover_path = NULL;
+// so that printing doesn't allocate, see main():
+static char stdout_buf[BUFSIZ];
+
+// chip names, indexed by the chip part of a pin number:
+char* gpio_chip[MAXCHIP] = { GPIOD_DEVICE };
+// poll rates in Hz for chips without edge detection, 0 for interrupts:
+int gpio_poll[MAXCHIP] = { 0 };
+// keypad matrices, indexed by the virtual chip that holds their keys:
+matrix_t *gpio_matrix[MAXCHIP] = { NULL };
+// set for chips that are really evdev input devices:
+int gpio_evdev[MAXCHIP] = { 0 };
+// set for chips that are really IIO devices:
+int gpio_iio[MAXCHIP] = { 0 };
 
 const char* control_types[] = {
         "NOCTL",
         "AUX",
         "ROTARY",
-        "SWITCH"
+        "SWITCH",
+        "ANALOG",
+        "CHORD"
 };
 
 const char* control_targets[] = {
@@ -68,38 +84,137 @@ const char* control_targets[] = {
         "OSC",
         "STDOUT",
         "MASTER",
-        "SLAVE"
+        "SLAVE",
+        "PLUGIN"
 };
 
-static void shutdown(int sig)
+static int sigfd = -1;
+
+static void handle_signal(void *data __attribute__((unused)))
 {
+	struct signalfd_siginfo si;
+
+	if (read(sigfd, &si, sizeof(si)) != sizeof(si))
+		return;
 	NFO("Received signal, terminating.");
-#ifdef HAVE_ALSA
-	if (use_alsa) {
-		shutdown_ALSA();
+	stop_eventloop(0);
+}
+
+// a coalescing window: changes within it are sent as one update when it
+// closes, with the latest value, or the sum of the deltas for masters.
+struct coalesce {
+	wheel_timer_t timer; // first, so that a timer is its window
+	control_t *c;
+	int ms;
+	int pending; // the window is open
+	int sum;
+};
+
+static void dispatch(control_t *c)
+{
+	// outputs that may block are sent from their worker thread:
+	if (c->out->worker) {
+		worker_send(c);
+		return;
 	}
-#endif
-#ifdef HAVE_JACK
-	if (use_jack) {
-		shutdown_JACK();
-		shutdown_ringbuffer();
+	c->out->update(c);
+	NFO("%s% 3d:%d\t-> %s\t% 3d", control_types[c->type], PIN_CHIP(c->pin1), PIN_LINE(c->pin1), control_targets[c->target], c->value);
+}
+
+static void close_window(wheel_timer_t *t)
+{
+	struct coalesce *co = (struct coalesce *)t;
+
+	if (!co->pending)
+		return;
+	co->pending = 0;
+	if (co->c->target == MASTER) {
+		// back and forth within the window, nothing to send:
+		if (co->sum == 0)
+			return;
+		co->c->value = co->sum;
+		co->sum = 0;
 	}
-#endif
-#ifdef HAVE_OSC
-	if (use_osc) {
-		shutdown_OSC();
+	dispatch(co->c);
+}
+
+static int setup_coalesce(control_t *c, int ms)
+{
+	struct coalesce *co;
+
+	DBG("Coalescing updates of controller %d over %d ms.", (int)(c - controller), ms);
+	co = calloc(1, sizeof(struct coalesce));
+	if (co == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	co->timer.fn = &close_window;
+	co->c = c;
+	co->ms = ms;
+	c->coalesce = co;
+	return 0;
+}
+
+static void shutdown_coalesce()
+{
+	// send what is still waiting for its window to close:
+	for (int i = 0; i < ncontrollers; i++) {
+		if (controller[i].coalesce == NULL)
+			continue;
+		timerwheel_del(&controller[i].coalesce->timer);
+		close_window(&controller[i].coalesce->timer);
+		free(controller[i].coalesce);
+		controller[i].coalesce = NULL;
+	}
+}
+
+// whether any input is on chip index. the default chip is always in the
+// table, but a setup without GPIO lines, say with only IIO inputs, need
+// not have it:
+static int chip_used(int index)
+{
+	control_cfg_t *cfg;
+
+	for (int i = 0; i < ncontrollers; i++) {
+		cfg = &controller_cfg[i];
+		if (PIN_CHIP(controller[i].pin1) == index)
+			return 1;
+		if (controller[i].type == ROTARY && PIN_CHIP(cfg->pin2) == index)
+			return 1;
+		for (int j = 0; j < cfg->chord_size; j++) {
+			if (PIN_CHIP(cfg->chord_pins[j]) == index)
+				return 1;
+		}
 	}
+	// matrices are scanned through the chip their rows are on:
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (gpio_matrix[i] != NULL && PIN_CHIP(gpio_matrix[i]->rows[0]) == index)
+			return 1;
+	}
+	return 0;
+}
+
+static int shutdown()
+{
+	int err;
+
+	shutdown_coalesce();
+	err = shutdown_outputs();
+#ifdef HAVE_OSC
 	if (use_slave) {
 		shutdown_SLAVE();
 	}
 #endif
 	shutdown_GPIOD();
-	exit(0);
+	shutdown_HANDOVER();
+	shutdown_eventloop();
+	return err;
 }
 
-void update(control_t* c, int delta)
+// the new value of a controller, returns 0 if nothing changed. mixer is
+// the current level of an ALSA control, or NULL to go on from our own:
+static int apply(control_t *c, int delta, int *mixer)
 {
-	DBG("update: delta = %d", delta);
 	switch (c->type) {
 	case ROTARY:
 	case AUX:
@@ -110,10 +225,11 @@ void update(control_t* c, int delta)
 		}
 #ifdef HAVE_ALSA
 		if (c->target == ALSA || c->target == SLAVE) {
-			// to avoid loudness jumps, we always re-read the current mixer value
-			// in case it got changed by someone else, and then apply a relative
-			// change
-			c->value = get_ALSA_value(c);
+			// to avoid loudness jumps, we always start from the current mixer
+			// value in case it got changed by someone else, and then apply a
+			// relative change.
+			if (mixer != NULL)
+				c->value = *mixer;
 			// clamp to our range. some mixers have min values of -999999 and max
 			// values of +4 or so...
 			if (c->value < c->min) c->value = c->min;
@@ -129,25 +245,34 @@ void update(control_t* c, int delta)
 			else c->step = 20;
 		}
 #endif
+		// delta can be more than one step if the rotary is accelerated
 		if ((delta < 0 && c->value > c->min)) {
-			if (c->value - c->step > c->min) {
-				c->value -= c->step;
+			if (c->value + delta * c->step > c->min) {
+				c->value += delta * c->step;
 			} else {
 				c->value = c->min;
 			}
 		} else if ((delta > 0 && c->value < c->max)) {
-			if (c->value + c->step < c->max) {
-				c->value += c->step;
+			if (c->value + delta * c->step < c->max) {
+				c->value += delta * c->step;
 			} else {
 				c->value = c->max;
 			}
 		} else
-			return;
+			return 0;
+		break;
+	case ANALOG:
+		// delta is the absolute position, scaled to 16 bits:
+		delta = c->min + (long long)delta * (c->max - c->min) / 65535;
+		if (delta == c->value)
+			return 0;
+		c->value = delta;
 		break;
 	case SWITCH:
+	case CHORD:
 		if (c->toggle) {
 			if (delta == 0)
-				return;
+				return 0;
 			if (c->value > c->min) {
 				c->value = c->min;
 			} else {
@@ -165,67 +290,97 @@ void update(control_t* c, int delta)
 		ERR("Unknown c->type %d. THIS SHOULD NEVER HAPPEN.", c->type);
 		break;
 	}
-	switch (c->target) {
-	case STDOUT:
-		update_STDOUT(c);
-		break;
-#ifdef HAVE_JACK
-	case JACK:
-		update_JACK(c);
-		break;
-#endif
+	return 1;
+}
+
+// a follower gets the value of the controller whose input it shares,
+// mapped to its own range. relative values can't be mapped, so masters
+// and everything that follows one apply the delta themselves, as do
+// switches and analog inputs, for which that is the same thing:
+static int follow(control_t *p, control_t *f, int delta)
+{
+	int value;
+
+	if (f->type != ROTARY || f->target == MASTER || p->target == MASTER)
+		return apply(f, delta, NULL);
+	if (p->max == p->min)
+		return 0;
+	value = f->min + (long long)(p->value - p->min) * (f->max - f->min) / (p->max - p->min);
+	if (value == f->value)
+		return 0;
+	f->value = value;
+	return 1;
+}
+
+static void send(control_t *c)
+{
+	if (c->coalesce) {
+		// the first change opens the window, the rest only update the value:
+		if (c->target == MASTER)
+			c->coalesce->sum += c->value;
+		if (!c->coalesce->pending) {
+			c->coalesce->pending = 1;
+			timerwheel_add(&c->coalesce->timer, c->coalesce->ms);
+		}
+		return;
+	}
+	dispatch(c);
+}
+
+void update(control_t* c, int delta)
+{
+	int changed, *mixer = NULL;
 #ifdef HAVE_ALSA
-	case ALSA:
-		update_ALSA(c);
-		break;
-	case SLAVE:
-		update_ALSA(c);
-		break;
+	int level;
 #endif
-#ifdef HAVE_OSC
-	case OSC:
-		update_OSC(c);
-		break;
-	case MASTER:
-		update_OSC(c);
-		break;
+
+	DBG("update: delta = %d", delta);
+#ifdef HAVE_ALSA
+	// while our own updates are still on their way, or the ALSA worker
+	// is busy with the mixer, we carry on from the value we sent last.
+	if ((c->type == ROTARY || c->type == AUX) && (c->target == ALSA || c->target == SLAVE)
+	    && !worker_busy(c->out) && !(c->coalesce && c->coalesce->pending)
+	    && get_ALSA_value(c, &level) == 0) {
+		mixer = &level;
+	}
 #endif
-	default:
-		ERR("Unknown c->target %d. THIS SHOULD NEVER HAPPEN.",
-		    c->target);
+	changed = apply(c, delta, mixer);
+	if (changed)
+		send(c);
+	// the value is decoded once, and then sent to every target:
+	for (control_t *f = c->also; f != NULL; f = f->also) {
+		changed = follow(c, f, delta);
+		if (changed)
+			send(f);
 	}
-	NFO("%s% 3d\t-> %s\t% 3d", control_types[c->type], c->pin1, control_targets[c->target], c->value);
 }
 
-void handle_gpi(int line, int delta)
+void handle_gpi(int ctl, int delta)
 {
 	// in order to properly debounce both rotary contacts, 
-	// aux lines now get their own event handler on the libgpiod side.
-	// over here, we must redirect them to their rotary main line.
-	// the linear search is ugly. FIXME!
-	control_t *c = controller[line];
-	if (c->type == AUX) {
-		for (int i=0; i < NCONTROLLERS; i++) {
-			if (controller[i] == NULL) continue;
-			if (controller[i]->pin2 == line) {
-				update(controller[i], delta);
-				break;
-			}
-		}
-	} else {
-		update(c, delta);
-	}
+	// aux lines get their own event handler on the libgpiod side,
+	// but they carry the index of their rotary, so there is no
+	// need to look anything up.
+	update(&controller[ctl], delta);
 }
 
 void handle_osc(control_t *c, int delta) {
-	update(c, delta);
+	// masters send delta * step, but the slave's fader taper decides
+	// the step size, so we only care about the direction.
+	update(c, (delta > 0) - (delta < 0));
 }
 
 int main(int argc, char *argv[])
 {
 	control_t *c;
+	sigset_t sigs;
+
+	int rval;
 
-	int rval = parse_cmdline(argc, argv);
+	// stdio would allocate its buffer when it first prints an update,
+	// long after startup. line buffered on a terminal, as before:
+	setvbuf(stdout, stdout_buf, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(stdout_buf));
+	rval = parse_cmdline(argc, argv);
 	switch (rval) {
 	case EXIT_USAGE:
 		usage();
@@ -239,56 +394,97 @@ int main(int argc, char *argv[])
 		exit(rval);
 	}
 
-	setup_GPIOD(GPIOD_DEVICE, PROGRAM_NAME, &handle_gpi);
-#ifdef HAVE_JACK
-	if (use_jack) {
-		setup_ringbuffer(JACK_BUFSIZE);
-		setup_JACK();
-	}
-#endif
-#ifdef HAVE_ALSA
-	if (use_alsa) {
-		setup_ALSA();
+	// signals only ever reach us through the event loop. this must
+	// happen before any threads are created, which inherit the mask:
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0) {
+		ERR("signalfd: errno = %d (%s).", errno, strerror(errno));
+		exit(2);
 	}
-#endif
-#ifdef HAVE_OSC
-	if (use_osc) {
-		setup_OSC();
-	}
-	if (use_slave) {
-		if (setup_SLAVE(osc_url, &handle_osc))
-			exit(2); // fatal with segfaults down the line
+	// if another instance is running, make sure we can take over from
+	// it. it carries on until we are ready, see take_HANDOVER() below:
+	if (handover_path && setup_HANDOVER(handover_path))
+		exit(2);
+	if (setup_eventloop(busy_cpu))
+		exit(2);
+	setup_GPIOD(PROGRAM_NAME, &handle_gpi);
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (gpio_chip[i] == NULL || gpio_matrix[i] != NULL)
+			continue;
+		if (gpio_evdev[i]) {
+			if (setup_GPIOD_evdev(i, gpio_chip[i]))
+				exit(2);
+			continue;
+		}
+		if (gpio_iio[i]) {
+			if (setup_GPIOD_iio(i, gpio_chip[i]))
+				exit(2);
+			continue;
+		}
+		if (!chip_used(i))
+			continue;
+		if (setup_GPIOD_chip(i, gpio_chip[i]))
+			exit(2);
+		if (gpio_poll[i] && setup_GPIOD_poll(i, gpio_poll[i]))
+			exit(2);
 	}
-#endif
-	for (int i = 0; i < NCONTROLLERS; i++) {
-		if (controller[i] == NULL)
+	// matrices need the chips their rows and columns are on:
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (gpio_matrix[i] == NULL)
 			continue;
-		c = controller[i];
+		if (setup_GPIOD_matrix(i, gpio_chip[i], gpio_matrix[i]))
+			exit(2);
+	}
+	if (setup_outputs())
+		exit(2);
+	for (int i = 0; i < ncontrollers; i++) {
+		c = &controller[i];
 		switch (c->target) {
 /* // can't happen since we gave auxes their own gpio handler
 		case NOTGT:
 			// this line is a dt pin for a rotary, without its own handler
 			continue;
 */
-#ifdef HAVE_ALSA
-		case ALSA:
-			if (c->type == AUX) break;
-			c->param1 = setup_ALSA_elem(c->param1);
-			// fall-through
-#endif
 		case JACK:
+		case ALSA:
 		case OSC:
 		case STDOUT:
 		case MASTER:
+		case PLUGIN:
+			if (c->out->setup_control && c->out->setup_control(c))
+				exit(2);
+			// another target of an input that is set up already:
+			if (CFG(c)->primary >= 0)
+				break;
 			switch (c->type) {
 			case ROTARY:
-				setup_GPIOD_rotary(c->pin1, c->pin2);
+				if (setup_GPIOD_rotary(c->pin1, CFG(c)->pin2, CFG(c)->res, i))
+					exit(2);
+				if (CFG(c)->accel > 1 && setup_GPIOD_accel(c->pin1, CFG(c)->accel, CFG(c)->accel_speed))
+					exit(2);
+				if (CFG(c)->debounce_max && (setup_GPIOD_debounce(c->pin1, CFG(c)->debounce_min, CFG(c)->debounce_max)
+				    || setup_GPIOD_debounce(CFG(c)->pin2, CFG(c)->debounce_min, CFG(c)->debounce_max)))
+					exit(2);
 				break;
 			case SWITCH:
-				setup_GPIOD_switch(c->pin1);
+				// gestures after all plain switches, which may share their pins
+				if (CFG(c)->gesture != NOGESTURE)
+					break;
+				if (setup_GPIOD_switch(c->pin1, i))
+					exit(2);
+				if (CFG(c)->debounce_max && setup_GPIOD_debounce(c->pin1, CFG(c)->debounce_min, CFG(c)->debounce_max))
+					exit(2);
+				break;
+			case ANALOG:
+				if (setup_GPIOD_analog(c->pin1, i, CFG(c)->hysteresis, CFG(c)->decimate))
+					exit(2);
 				break;
-			case AUX:
-				// do nothing
+			case CHORD:
+				// after all switches, which may share its pins
 				break;
 			default:
 				ERR("c->type %d can't happen here. BUG?", c->type);
@@ -297,8 +493,8 @@ int main(int argc, char *argv[])
 #ifdef HAVE_ALSA
 #  ifdef HAVE_OSC
 		case SLAVE:
+			// its handler goes in once the OSC server is up, below
 			c->param1 = setup_ALSA_elem(c->param1);
-			setup_SLAVE_handler(c->param2, c);
 			break;
 #  endif
 #endif
@@ -307,13 +503,56 @@ int main(int argc, char *argv[])
 			    c->target);
 		}
 	}
+	for (int i = 0; i < ncontrollers; i++) {
+		c = &controller[i];
+		if (c->type == CHORD && CFG(c)->primary < 0 && setup_GPIOD_chord(CFG(c)->chord_pins, CFG(c)->chord_size, i))
+			exit(2);
+		if (CFG(c)->coalesce_ms && setup_coalesce(c, CFG(c)->coalesce_ms))
+			exit(2);
+		if (c->type == SWITCH && c->target != SLAVE && CFG(c)->gesture != NOGESTURE && CFG(c)->primary < 0) {
+			if (setup_GPIOD_gesture(c->pin1, CFG(c)->gesture, CFG(c)->gesture_ms, i))
+				exit(2);
+			if (CFG(c)->debounce_max && setup_GPIOD_debounce(c->pin1, CFG(c)->debounce_min, CFG(c)->debounce_max))
+				exit(2);
+		}
+		free(CFG(c)->chord_pins);
+	}
+	free(controller_cfg);
+	controller_cfg = NULL;
 
-	signal(SIGTERM, &shutdown);
-	signal(SIGINT, &shutdown);
+	// only now that everything else is ready does our predecessor, if
+	// any, stop reading events and hand us its lines and values. from
+	// here to start_GPIOD(), its edges queue up in the kernel:
+	if (take_HANDOVER())
+		exit(2); // our predecessor carries on
 #ifdef HAVE_OSC
-	if (use_slave) start_SLAVE(); // this one spawns a thread
+	// the OSC server socket may have been handed over just now:
+	if (use_slave) {
+		if (setup_SLAVE(osc_url, &handle_osc))
+			exit(2); // fatal with segfaults down the line
+#  ifdef HAVE_ALSA
+		for (int i = 0; i < ncontrollers; i++) {
+			if (controller[i].target == SLAVE)
+				setup_SLAVE_handler(controller[i].param2, &controller[i]);
+		}
+#  endif
+	}
 #endif
-	start_GPIOD(); // this one goes to sleep
-
-	sleep(-1);
+	if (eventloop_add(sigfd, &handle_signal, NULL))
+		exit(2);
+#ifdef HAVE_OSC
+	if (use_slave && start_SLAVE())
+		exit(2);
+#endif
+	if (start_GPIOD())
+		exit(2); // our predecessor, if any, carries on
+	if (start_HANDOVER())
+		exit(2);
+	if (start_GPIOD_scanners())
+		exit(2);
+	// everything happens in here, until we get a signal:
+	rval = run_eventloop();
+	if (shutdown())
+		_exit(2); // exit() would block flushing output nobody reads
+	exit(rval ? 2 : 0);
 }
@@ -17,10 +17,40 @@
 */
 
 #include "osc_process.h"
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <lo/lo.h>
 #include <errno.h>
 #include "globals.h"
+#include "osc_cmdline.h"
+#include "master_cmdline.h"
+
+// room for the path, the type tag and the argument, all padded to
+// four bytes:
+#define OSC_MAXMSG (MAXNAME + 12)
+
+// where an OSC controller sends to, and its message, built once so that
+// sending a value doesn't allocate. liblo allocates whenever it sends,
+// so UDP messages go out on a socket of our own, with only the argument
+// patched in. other protocols are left to liblo.
+typedef struct osc_target {
+	char *url;
+	int fd; // -1 unless UDP
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	lo_address addr;
+	lo_message msg;
+	lo_arg *arg; // the argument of msg
+	size_t len;
+	char buf[OSC_MAXMSG];
+	struct osc_target *next;
+} osc_target_t;
+
+static osc_target_t *targets = NULL;
 
 int setup_OSC()
 {
@@ -28,25 +58,112 @@ int setup_OSC()
         return 0;
 }
 
+static int setup_OSC_socket(osc_target_t *t)
+{
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+	struct addrinfo *ai;
+	char *host = lo_url_get_hostname(t->url);
+	char *port = lo_url_get_port(t->url);
+	int on = 1;
+	int err;
+
+	err = getaddrinfo(host, port, &hints, &ai);
+	free(host);
+	free(port);
+	if (err) {
+		ERR("Could not resolve OSC URL '%s': %s.", t->url, gai_strerror(err));
+		return -EINVAL;
+	}
+	t->fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+	if (t->fd < 0) {
+		ERR("Could not open OSC socket: errno = %d (%s).", errno, strerror(errno));
+		freeaddrinfo(ai);
+		return -errno;
+	}
+	// like liblo, so that broadcast URLs keep working:
+	setsockopt(t->fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+	memcpy(&t->sa, ai->ai_addr, ai->ai_addrlen);
+	t->salen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+static int setup_OSC_control(control_t *c)
+{
+	osc_target_t *t;
+
+	DBG("Preparing OSC message '%s' to %s.", (char *)c->param2, (char *)c->param1);
+	t = calloc(1, sizeof(osc_target_t));
+	if (t == NULL) {
+		ERR("calloc() failed.");
+		return -ENOMEM;
+	}
+	// like the ALSA output's mixer element, this takes the place of
+	// the URL from the command line:
+	t->url = c->param1;
+	c->param1 = t;
+	t->fd = -1;
+	t->next = targets;
+	targets = t;
+	t->msg = lo_message_new();
+	if (t->msg == NULL || lo_message_add_int32(t->msg, c->value)) {
+		ERR("Could not create OSC message '%s'.", (char *)c->param2);
+		return -ENOMEM;
+	}
+	t->arg = lo_message_get_argv(t->msg)[0];
+	t->len = lo_message_length(t->msg, (char *)c->param2);
+	if (t->len > OSC_MAXMSG) {
+		ERR("OSC path '%s' is too long.", (char *)c->param2);
+		return -EINVAL;
+	}
+	lo_message_serialise(t->msg, (char *)c->param2, t->buf, &t->len);
+	if (lo_url_get_protocol_id(t->url) == LO_UDP)
+		return setup_OSC_socket(t);
+	t->addr = lo_address_new_from_url(t->url);
+	if (t->addr == NULL) {
+		ERR("Could not create OSC address from URL '%s'.", t->url);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 int shutdown_OSC()
 {
+	osc_target_t *t;
+
         DBG("Shutting down OSC.");
+	// both the osc and the master outputs end up here:
+	while (targets != NULL) {
+		t = targets;
+		targets = t->next;
+		if (t->fd >= 0)
+			close(t->fd);
+		if (t->addr)
+			lo_address_free(t->addr);
+		if (t->msg)
+			lo_message_free(t->msg);
+		free(t);
+	}
         return 0;
 }
 
 int update_OSC(control_t * c)
 {
+	osc_target_t *t = c->param1;
+	uint32_t v;
 	int e;
+
 	DBG("Updating OSC message queue: '%s %d' -> %s", 
-	    (char*)c->param2, c->value, (char *)c->param1);
-	lo_address addr = lo_address_new_from_url((char *)c->param1);
-	if (addr == NULL) {
-		ERR("Could not create OSC address from URL '%s'.",
-		    (char *)c->param1);
-                return -EINVAL;
-	}
-	e = lo_send(addr, (char *)c->param2, "i", (char *)c->value);
-	lo_address_free(addr);
+	    (char*)c->param2, c->value, t->url);
+	if (t->fd >= 0) {
+		// the argument is the last four bytes, in network order:
+		v = htonl((uint32_t)c->value);
+		memcpy(t->buf + t->len - sizeof(v), &v, sizeof(v));
+		e = (sendto(t->fd, t->buf, t->len, 0, (struct sockaddr *)&t->sa, t->salen) < 0) ? -1 : 0;
+	} else {
+		t->arg->i = c->value;
+		e = lo_send_message(t->addr, (char *)c->param2, t->msg);
+	}
 	if (e == -1) {
 	        ERR("Could not send OSC message '%s %d'.", 
 	            (char *)c->param2, c->value);
@@ -54,3 +171,31 @@ int update_OSC(control_t * c)
 	}
 	return 0;
 }
+
+output_t output_OSC = {
+	.abi = OUTPUT_ABI,
+	.name = "osc",
+	.help_rotary = &help_rotary_OSC,
+	.help_switch = &help_switch_OSC,
+	.parse_rotary = &parse_cmdline_rotary_OSC,
+	.parse_switch = &parse_cmdline_switch_OSC,
+	.setup = &setup_OSC,
+	.setup_control = &setup_OSC_control,
+	.update = &update_OSC,
+	.shutdown = &shutdown_OSC,
+	// liblo may have to wait for a TCP peer:
+	.blocking = 1
+};
+
+output_t output_MASTER = {
+	.abi = OUTPUT_ABI,
+	.name = "master",
+	.help_rotary = &help_rotary_MASTER,
+	.help_switch = &help_switch_MASTER,
+	.parse_rotary = &parse_cmdline_rotary_MASTER,
+	.parse_switch = &parse_cmdline_switch_MASTER,
+	.setup_control = &setup_OSC_control,
+	.update = &update_OSC,
+	.shutdown = &shutdown_OSC,
+	.blocking = 1
+};
@@ -20,6 +20,10 @@
 #define OSC_PROCESS_H
 
 #include "globals.h"
+#include "output.h"
+
+extern output_t output_OSC;
+extern output_t output_MASTER;
 
 int setup_OSC();
 int shutdown_OSC();
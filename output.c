@@ -0,0 +1,181 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/* Output targets.
+ *
+ * Each target is an output_t with its own parsers and update function.
+ * The built-in ones are registered here, and plugins can add more from
+ * a shared object that exports OUTPUT_SYMBOL. The parser resolves each
+ * controller's output once, so that sending a value is a single call
+ * through c->out, no matter how many outputs there are.
+ */
+
+#include "output.h"
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include "worker.h"
+#include "stdout_process.h"
+#include "stdout_cmdline.h"
+#ifdef HAVE_JACK
+#include "jack_process.h"
+#endif
+#ifdef HAVE_ALSA
+#include "alsa_process.h"
+#endif
+#ifdef HAVE_OSC
+#include "osc_process.h"
+#endif
+
+static output_t *outputs = NULL;
+static output_t *last = NULL;
+
+int register_output(output_t *o)
+{
+	// nothing else is worth a look if the layout isn't ours:
+	if (o->abi != OUTPUT_ABI) {
+		ERR("Output ABI %u is not ours (%d), it was built for another version of %s.",
+		    o->abi, OUTPUT_ABI, PROGRAM_NAME);
+		return -EINVAL;
+	}
+	if (o->name == NULL || o->update == NULL || (o->parse_rotary == NULL && o->parse_switch == NULL)) {
+		ERR("Output %s is incomplete.", o->name ? o->name : "without a name");
+		return -EINVAL;
+	}
+	DBG("Registering output %s.", o->name);
+	if (find_output((char *)o->name) != NULL) {
+		ERR("There already is an output called %s.", o->name);
+		return -EEXIST;
+	}
+	o->next = NULL;
+	if (last == NULL)
+		outputs = o;
+	else
+		last->next = o;
+	last = o;
+	return 0;
+}
+
+static void register_builtins()
+{
+	static int done = 0;
+
+	if (done++)
+		return;
+#ifdef HAVE_JACK
+	register_output(&output_JACK);
+#endif
+#ifdef HAVE_ALSA
+	register_output(&output_ALSA);
+#endif
+#ifdef HAVE_OSC
+	register_output(&output_OSC);
+	register_output(&output_MASTER);
+#endif
+	register_output(&output_STDOUT);
+}
+
+int load_output(char *path)
+{
+	output_t *o;
+	void *dl;
+	int err;
+
+	DBG("Loading output from %s.", path);
+	register_builtins();
+	dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (dl == NULL) {
+		ERR("Could not load %s: %s.", path, dlerror());
+		return -ENOENT;
+	}
+	o = dlsym(dl, OUTPUT_SYMBOL);
+	if (o == NULL) {
+		ERR("%s does not export %s.", path, OUTPUT_SYMBOL);
+		dlclose(dl);
+		return -ENOENT;
+	}
+	err = register_output(o);
+	if (err) {
+		ERR("Could not load %s.", path);
+		dlclose(dl);
+		return err;
+	}
+	o->dl = dl;
+	return 0;
+}
+
+output_t *find_output(char *name)
+{
+	register_builtins();
+	for (output_t *o = outputs; o != NULL; o = o->next) {
+		if (strcmp(o->name, name) == 0)
+			return o;
+	}
+	return NULL;
+}
+
+void help_outputs(int rotary)
+{
+	register_builtins();
+	for (output_t *o = outputs; o != NULL; o = o->next) {
+		if (rotary && o->help_rotary != NULL) {
+			o->help_rotary();
+			printf("\n");
+		} else if (!rotary && o->help_switch != NULL) {
+			o->help_switch();
+			printf("\n");
+		}
+	}
+}
+
+int setup_outputs()
+{
+	int err;
+
+	for (output_t *o = outputs; o != NULL; o = o->next) {
+		if (!o->used)
+			continue;
+		DBG("Setting up output %s.", o->name);
+		if (o->setup != NULL) {
+			err = o->setup();
+			if (err)
+				return err;
+		}
+		if (o->blocking) {
+			err = setup_worker(o);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+int shutdown_outputs()
+{
+	int err = 0;
+
+	// let the workers deliver what's left while the outputs still exist:
+	for (output_t *o = outputs; o != NULL; o = o->next) {
+		if (o->worker != NULL && shutdown_worker(o))
+			err = -EBUSY;
+	}
+	for (output_t *o = outputs; o != NULL; o = o->next) {
+		if (o->used && o->shutdown != NULL)
+			o->shutdown();
+	}
+	return err;
+}
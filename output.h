@@ -0,0 +1,67 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "globals.h"
+
+// bump this whenever output_t or control_t change, so that outputs
+// built against another version are refused:
+#define OUTPUT_ABI 1
+
+// the symbol an output plugin exports, pointing to its output_t:
+#define OUTPUT_SYMBOL "gpioctl_output"
+
+// an output target. built-in ones are registered on first use,
+// plugins are loaded with -O. everything but name, the parsers and
+// update may be NULL.
+typedef struct output {
+	unsigned int abi; // OUTPUT_ABI
+	const char *name; // the type on the command line
+	// print the target arguments for -h:
+	void (*help_rotary)();
+	void (*help_switch)();
+	// parse the target arguments of a controller. config[] is as for
+	// the built-in targets, see *_cmdline.c:
+	int (*parse_rotary)(control_t *c, char *config[]);
+	int (*parse_switch)(control_t *c, char *config[]);
+	// once, if any controller uses this output:
+	int (*setup)();
+	// for each of its controllers, after setup():
+	int (*setup_control)(control_t *c);
+	// send the value of c. runs in a worker thread of its own if
+	// blocking is set, otherwise on the event loop, where it must
+	// never block:
+	int (*update)(control_t *c);
+	int (*shutdown)();
+	int blocking;
+	// gpioctl's business:
+	int used;
+	struct worker *worker;
+	struct output *next;
+	void *dl;
+} output_t;
+
+int register_output(output_t *o);
+int load_output(char *path);
+output_t *find_output(char *name);
+void help_outputs(int rotary);
+int setup_outputs();
+int shutdown_outputs();
+
+#endif
@@ -24,21 +24,18 @@
 #include <limits.h>
 #include "globals.h"
 #include "build/config.h"
-#include "stdout_cmdline.h"
-
-#ifdef HAVE_JACK
-#include "jack_cmdline.h"
-#endif
+#include "output.h"
 
 #ifdef HAVE_ALSA
-#include "alsa_cmdline.h"
+#  ifdef HAVE_OSC
+#include "alsa_process.h"
 #include "slave_cmdline.h"
+#  endif
 #endif
 
-#ifdef HAVE_OSC
-#include "osc_cmdline.h"
-#include "master_cmdline.h"
-#endif
+// the setup of the input that drives a controller, which is its own
+// unless it is another target of an earlier controller:
+#define INPUT_CFG(c) (CFG(c)->primary < 0 ? CFG(c) : &controller_cfg[CFG(c)->primary])
 
 void usage()
 {
@@ -49,49 +46,108 @@ void usage()
 	printf("We assume GPI pins have a pull-up, so the return should be connected to ground.\n\n");
 	printf("-h|--help      This help.\n");
 	printf("-V|--version   Print version and exit.\n");
-	printf("-v|--verbose   Print current controller values.\n\n");
+	printf("-v|--verbose   Print current controller values.\n");
+	printf("-B|--busy-poll cpu\n");
+	printf("               Instead of sleeping until an edge or message arrives, spin\n");
+	printf("               on cpu number 'cpu' and handle it as soon as it is seen.\n");
+	printf("               This burns a whole core, which should be isolated from the\n");
+	printf("               scheduler. Use -v to compare the latency with the default.\n");
+	printf("-H|--handover path\n");
+	printf("               Wait for a new instance on the UNIX socket at 'path' and\n");
+	printf("               hand over the GPIO lines, input devices, the OSC slave\n");
+	printf("               socket and all controller values to it, then exit. If an\n");
+	printf("               instance is already waiting there, take over from it.\n");
+	printf("-P|--poll chip[,rate]\n");
+	printf("               Read the lines of a GPIO chip that can't detect edges by\n");
+	printf("               itself, 'rate' times per second (default %d). Useful for\n", DEFAULT_POLL_RATE);
+	printf("               some I2C or SPI expanders. May be given once per chip.\n");
+	printf("-m|--matrix rows,cols[,rate]\n");
+	printf("               Scan a keypad matrix. 'rows' and 'cols' are lists of pins\n");
+	printf("               joined by '+', all on the same chip. Rows are driven low one\n");
+	printf("               after the other, 'rate' times per second (default %d),\n", DEFAULT_SCAN_RATE);
+	printf("               and columns are read back with pull-ups. The first matrix\n");
+	printf("               becomes chip matrix0, the next one matrix1 and so on. Its\n");
+	printf("               keys are used like switches, as matrix0:key, where key is\n");
+	printf("               row * (number of columns) + column, counting from 0.\n");
+	printf("-O|--output path\n");
+	printf("               Load an output plugin from the shared object at 'path', to\n");
+	printf("               be used as a type of its own (see output.h). Must come\n");
+	printf("               before the controls that use it. May be given more than once.\n\n");
 	printf("The following options may be specified multiple times. All parameters must be\n");
 	printf("separated by commas, no spaces. Parameters in brackets are optional.\n\n");
 	printf("-r|--rotary clk,dt,type,...\n");
 	printf("               Set up a rotary encoder.\n");
-	printf("               clk:     the GPI number of the first encoder contact (0-%d)\n", MAXGPIO - 1);
-	printf("               dt:      the GPI number of the second encoder contact (0-%d)\n", MAXGPIO - 1);
+	printf("               clk:     the GPI number of the first encoder contact\n");
+	printf("               dt:      the GPI number of the second encoder contact\n");
+	printf("                        (see below for pins on other GPIO chips)\n");
 	printf("               Depending on 'type', the remaining parameters are:\n\n");
-#ifdef HAVE_JACK
-	help_rotary_JACK();
-	printf("\n");
-#endif
-#ifdef HAVE_ALSA
-	help_rotary_ALSA();
-	printf("\n");
-#endif
-#ifdef HAVE_OSC
-	help_rotary_OSC();
-	printf("\n");
-	help_rotary_MASTER();
-	printf("\n");
-#endif
-	help_rotary_STDOUT();
-	printf("\n");
+	help_outputs(1);
 	printf("-s|--switch sw,type...\n");
 	printf("               Set up a switch.\n");
-	printf("               sw:      the GPI pin number of the switch contact (0-%d)\n", MAXGPIO - 1);
+	printf("               sw:      the GPI pin number of the switch contact\n");
+	printf("                        (see below for pins on other GPIO chips)\n");
 	printf("               Depending on 'type', the remaining parameters are:\n\n");
-#ifdef HAVE_JACK
-	help_switch_JACK();
+	help_outputs(0);
+	printf("-e|--evdev device,code,type,...\n");
+	printf("               Use a key or axis of an input device instead of GPIO lines,\n");
+	printf("               such as those of the kernel's gpio-keys and rotary-encoder\n");
+	printf("               drivers. 'device' is a path like /dev/input/event0, and\n");
+	printf("               'code' is rel:N for a relative axis, which acts like a\n");
+	printf("               rotary, or key:N for a key, which acts like a switch. See\n");
+	printf("               linux/input-event-codes.h or run evtest for the numbers.\n");
+	printf("               'type' and the rest are as for -r and -s, respectively.\n");
 	printf("\n");
-#endif
-#ifdef HAVE_ALSA
-	help_switch_ALSA();
+	printf("-a|--analog device,channel,type,...\n");
+	printf("               Set up an analog input, such as a fader or potentiometer on\n");
+	printf("               an ADC. 'device' is an IIO device like /dev/iio:device0 with\n");
+	printf("               a triggered buffer, and 'channel' is N for in_voltageN.\n");
+	printf("               'type' and the rest are as for -r. Its range is mapped to\n");
+	printf("               the whole range of the target. The step size is ignored.\n");
+	printf("               Analog inputs also take these key=value options:\n");
+	printf("      hysteresis=N\n");
+	printf("               ignore changes of up to N ADC counts (default %d)\n", DEFAULT_HYSTERESIS);
+	printf("      decimate=N\n");
+	printf("               average N samples before looking for a change (default %d)\n", DEFAULT_DECIMATE);
+	printf("      coalesce=ms\n");
+	printf("               as for rotaries, see below.\n");
 	printf("\n");
-#endif
-#ifdef HAVE_OSC
-	help_switch_OSC();
+	printf("-c|--chord sw+sw[+sw...],type,...\n");
+	printf("               Set up a chord: it is pressed when exactly these switches\n");
+	printf("               are held down together, and released when any of them is\n");
+	printf("               let go. Each switch may also have its own -s control. 'type'\n");
+	printf("               and the rest are as for -s. Up to %d switches can take part\n", MAXCHORDSWITCHES);
+	printf("               in chords.\n");
 	printf("\n");
-	help_switch_MASTER();
+	printf("A control can drive several targets: give it again with the same pins\n");
+	printf("and another target. Rotaries map their value to each target's range.\n");
 	printf("\n");
-#endif
-	help_switch_STDOUT();
+	printf("Rotaries and switches also accept the following key=value options,\n");
+	printf("anywhere after the pin numbers or evdev codes:\n\n");
+	printf("      res=1|2|4\n");
+	printf("               rotary only: detents per quadrature cycle. Use 1 for full-step\n");
+	printf("               encoders, 2 for half-step encoders like the ALPS EC11 (default),\n");
+	printf("               and 4 to count every edge (quarter-step and optical encoders).\n");
+	printf("      accel=factor[:speed]\n");
+	printf("               rotary only: when turned fast, multiply the step size by up to\n");
+	printf("               'factor'. The full factor is reached at 'speed' detents per\n");
+	printf("               second (default %d). Below a tenth of that, there is no\n", DEFAULT_ACCEL_SPEED);
+	printf("               acceleration. Has no effect on master rotaries.\n");
+	printf("      coalesce=ms\n");
+	printf("               rotary only: collect all changes for up to 'ms' and then\n");
+	printf("               send only the result, instead of one update per detent.\n");
+	printf("               Master rotaries send the sum of their deltas.\n");
+	printf("      debounce=min:max\n");
+	printf("               learn the debounce window of each line from its bouncing,\n");
+	printf("               within min and max microseconds. The kernel will not\n");
+	printf("               debounce these lines, so gpioctl can see the bounces.\n");
+	printf("      urgent=0|1\n");
+	printf("               send updates ahead of any queued ones of non-urgent\n");
+	printf("               controllers. Switches and chords are urgent by default.\n");
+	printf("      gesture=click|long[:ms]|double[:ms]\n");
+	printf("               switch only: react to a click, a press longer than 'ms'\n");
+	printf("               (default %d), or two clicks within 'ms' (default %d)\n", DEFAULT_LONG_PRESS, DEFAULT_DOUBLE_CLICK);
+	printf("               instead of every press. A switch can have one controller\n");
+	printf("               per gesture, plus one without.\n");
 	printf("\n");
 #ifdef HAVE_OSC
 #  ifdef HAVE_ALSA
@@ -101,6 +157,9 @@ void usage()
 	printf("Pin numbers above are hardware GPIO numbers. They do not usually correspond\n");
 	printf("to physical pin numbers. For the RPi, check https://pinout.xyz/# and look\n");
 	printf("for the Broadcom ('BCM') numbers.\n");
+	printf("Pins on %s are given as plain numbers. Pins on other GPIO chips (such as\n", GPIOD_DEVICE);
+	printf("I2C expanders) are given as chip:line, where chip is a name like gpiochip1,\n");
+	printf("a path like /dev/gpiochip1, or just the number 1. Up to %d chips can be used.\n", MAXCHIP);
 	printf("libgpiod does not know how to control the pull-up/pull-down resistors of your\n");
 	printf("GPIO pins. Use a hardware-specific external tool to enable them, or add\n");
 	printf("physical pull-ups.\n\n");
@@ -111,7 +170,7 @@ void usage()
 static void debugmsg(control_t * c)
 {
 	DBG("Parsed control %s(%d|%d)->%s [%d..%d] step=%d toggle=%d midi_ch=%d midi_cc=%d param1=%s param2=%s value=%d",
-	    control_types[c->type], c->pin1, c->pin2, control_targets[c->target], c->min, c->max, c->step, c->toggle, c->midi_ch, c->midi_cc,
+	    control_types[c->type], c->pin1, CFG(c)->pin2, control_targets[c->target], c->min, c->max, c->step, c->toggle, c->midi_ch, c->midi_cc,
 	    (c->param1 == NULL) ? "''" : (char *)c->param1, (c->param2 == NULL) ? "''" : (char *)c->param2, c->value);
 }
 
@@ -129,6 +188,400 @@ static int tokenize(char *argument, char *config[])
         return i;
 }
 
+static int match(char *string1, char *string2);
+
+static int parse_options(control_t *c, char *config[], int n)
+{
+	// generic key=value options can appear anywhere after the pins.
+	// we consume them here, so that the target parsers only ever see
+	// their positional arguments.
+	int k = 0;
+	char *sep;
+	// a switch is usually something you want to happen right now:
+	c->urgent = (c->type == SWITCH || c->type == CHORD);
+	for (int j = 0; j < n; j++) {
+		if (match(config[j], "urgent=")) {
+			c->urgent = atoi(config[j] + 7);
+			if (c->urgent != 0 && c->urgent != 1) {
+				ERR("urgent must be 0 or 1.");
+				return -1;
+			}
+		} else if (match(config[j], "res=")) {
+			if (c->type != ROTARY) {
+				ERR("res= only applies to rotaries.");
+				return -1;
+			}
+			CFG(c)->res = atoi(config[j] + 4);
+			if (CFG(c)->res != 1 && CFG(c)->res != 2 && CFG(c)->res != 4) {
+				ERR("res must be 1, 2 or 4.");
+				return -1;
+			}
+		} else if (match(config[j], "accel=")) {
+			if (c->type != ROTARY) {
+				ERR("accel= only applies to rotaries.");
+				return -1;
+			}
+			sep = strchr(config[j], ':');
+			CFG(c)->accel = atoi(config[j] + 6);
+			CFG(c)->accel_speed = (sep == NULL) ? DEFAULT_ACCEL_SPEED : atoi(sep + 1);
+			if (CFG(c)->accel < 1 || CFG(c)->accel_speed < 1) {
+				ERR("accel factor and speed must be positive.");
+				return -1;
+			}
+		} else if (match(config[j], "hysteresis=")) {
+			if (c->type != ANALOG) {
+				ERR("hysteresis= only applies to analog inputs.");
+				return -1;
+			}
+			CFG(c)->hysteresis = atoi(config[j] + 11);
+			if (CFG(c)->hysteresis < 0) {
+				ERR("hysteresis must not be negative.");
+				return -1;
+			}
+		} else if (match(config[j], "decimate=")) {
+			if (c->type != ANALOG) {
+				ERR("decimate= only applies to analog inputs.");
+				return -1;
+			}
+			CFG(c)->decimate = atoi(config[j] + 9);
+			if (CFG(c)->decimate < 1) {
+				ERR("decimate must be positive.");
+				return -1;
+			}
+		} else if (match(config[j], "gesture=")) {
+			if (c->type != SWITCH) {
+				ERR("gesture= only applies to switches.");
+				return -1;
+			}
+			sep = strchr(config[j], ':');
+			if (match(config[j] + 8, "click")) {
+				CFG(c)->gesture = CLICK;
+				CFG(c)->gesture_ms = 1;
+			} else if (match(config[j] + 8, "long")) {
+				CFG(c)->gesture = LONGPRESS;
+				CFG(c)->gesture_ms = (sep == NULL) ? DEFAULT_LONG_PRESS : atoi(sep + 1);
+			} else if (match(config[j] + 8, "double")) {
+				CFG(c)->gesture = DOUBLECLICK;
+				CFG(c)->gesture_ms = (sep == NULL) ? DEFAULT_DOUBLE_CLICK : atoi(sep + 1);
+			} else {
+				ERR("gesture must be click, long or double.");
+				return -1;
+			}
+			if (CFG(c)->gesture_ms < 1) {
+				ERR("gesture time must be positive.");
+				return -1;
+			}
+		} else if (match(config[j], "coalesce=")) {
+			if (c->type != ROTARY && c->type != ANALOG) {
+				ERR("coalesce= only applies to rotaries and analog inputs.");
+				return -1;
+			}
+			CFG(c)->coalesce_ms = atoi(config[j] + 9);
+			if (CFG(c)->coalesce_ms < 1) {
+				ERR("coalesce time must be positive.");
+				return -1;
+			}
+		} else if (match(config[j], "debounce=")) {
+			if (c->type == ANALOG || c->type == CHORD) {
+				ERR("debounce= only applies to rotaries and switches.");
+				return -1;
+			}
+			sep = strchr(config[j], ':');
+			if (sep == NULL) {
+				ERR("debounce needs a range, like debounce=10:2000.");
+				return -1;
+			}
+			CFG(c)->debounce_min = atoi(config[j] + 9);
+			CFG(c)->debounce_max = atoi(sep + 1);
+			if (CFG(c)->debounce_min < 0 || CFG(c)->debounce_max < 1 || CFG(c)->debounce_min > CFG(c)->debounce_max) {
+				ERR("invalid debounce range.");
+				return -1;
+			}
+		} else {
+			config[k++] = config[j];
+		}
+	}
+	for (int j = k; j < MAXARG; j++) {
+		config[j] = NULL;
+	}
+	return k;
+}
+
+static int find_chip(char *name)
+{
+	char chip[MAXNAME];
+
+	// normalize to the bare chip name:
+	if (strncmp(name, "/dev/", 5) == 0) {
+		name += 5;
+	}
+	if (strspn(name, "0123456789") == strlen(name)) {
+		snprintf(chip, MAXNAME, "gpiochip%s", name);
+	} else {
+		strncpy(chip, name, MAXNAME - 1);
+		chip[MAXNAME - 1] = '\0';
+	}
+	for (int i = 0; i < MAXCHIP; i++) {
+		if (gpio_chip[i] == NULL) {
+			gpio_chip[i] = strdup(chip);
+			if (gpio_chip[i] == NULL) {
+				ERR("strdup() failed.");
+				return -1;
+			}
+			return i;
+		}
+		if (strcmp(gpio_chip[i], chip) == 0)
+			return i;
+	}
+	ERR("Too many GPIO chips. Compile-time limit is %d.", MAXCHIP);
+	return -1;
+}
+
+static int parse_pin(char *arg)
+{
+	char *sep;
+	int chip = 0;
+	int line;
+
+	if (arg == NULL || *arg == '\0')
+		return -1;
+	sep = strrchr(arg, ':');
+	if (sep != NULL) {
+		*sep = '\0';
+		chip = find_chip(arg);
+		if (chip < 0)
+			return -1;
+		arg = sep + 1;
+	}
+	line = atoi(arg);
+	// the actual number of lines is checked when the chip is opened
+	if (line < 0 || line >= (1 << PIN_SHIFT))
+		return -1;
+	return PIN(chip, line);
+}
+
+static int parse_pin_list(char *list, unsigned int **pins)
+{
+	char *token, *saveptr;
+	int n = 1;
+	int pin;
+
+	for (char *p = list; *p; p++) {
+		if (*p == '+')
+			n++;
+	}
+	*pins = calloc(sizeof(unsigned int), n);
+	if (*pins == NULL) {
+		ERR("calloc() failed.");
+		return -1;
+	}
+	n = 0;
+	for (token = strtok_r(list, "+", &saveptr); token != NULL; token = strtok_r(NULL, "+", &saveptr)) {
+		pin = parse_pin(token);
+		if (pin < 0)
+			return -1;
+		(*pins)[n++] = pin;
+	}
+	return n;
+}
+
+static int add_matrix(char *config[])
+{
+	static int nmatrices = 0;
+	char name[MAXNAME];
+	matrix_t *m;
+	int chip;
+	int n;
+
+	if (config[0] == NULL || config[1] == NULL) {
+		ERR("A matrix needs rows and columns.");
+		return -1;
+	}
+	snprintf(name, MAXNAME, "matrix%d", nmatrices++);
+	chip = find_chip(name);
+	if (chip < 0)
+		return -1;
+	m = calloc(sizeof(matrix_t), 1);
+	if (m == NULL) {
+		ERR("calloc() failed.");
+		return -1;
+	}
+	gpio_matrix[chip] = m;
+	n = parse_pin_list(config[0], &m->rows);
+	if (n < 1) {
+		ERR("Invalid matrix rows.");
+		return -1;
+	}
+	m->nrows = n;
+	n = parse_pin_list(config[1], &m->cols);
+	if (n < 1) {
+		ERR("Invalid matrix columns.");
+		return -1;
+	}
+	m->ncols = n;
+	m->rate = (config[2] == NULL) ? DEFAULT_SCAN_RATE : atoi(config[2]);
+	if (m->rate < m->nrows) {
+		ERR("Scan rate must be at least one full scan per second.");
+		return -1;
+	}
+	DBG("%s has %d rows and %d columns, scanned at %d rows per second.", name, m->nrows, m->ncols, m->rate);
+	return 0;
+}
+
+static int parse_target(control_t *c, char *type, char *config[], int rotary)
+{
+	output_t *o = find_output(type);
+
+	c->param1 = calloc(sizeof(char), MAXNAME);
+	c->param2 = calloc(sizeof(char), MAXNAME);
+	if (c->param1 == NULL || c->param2 == NULL) {
+		ERR("calloc() failed.");
+		return -1;
+	}
+	if (o == NULL || (rotary ? o->parse_rotary : o->parse_switch) == NULL) {
+		ERR("Unknown type '%s'.", type);
+		return -1;
+	}
+	// the built-in outputs set their own target:
+	c->target = PLUGIN;
+	if ((rotary ? o->parse_rotary : o->parse_switch)(c, config))
+		return -1;
+	c->out = o;
+	o->used = 1;
+	return 0;
+}
+
+static int parse_rotary_target(control_t *c, char *config[])
+{
+	return parse_target(c, config[2], config, 1);
+}
+
+static int parse_switch_target(control_t *c, char *config[])
+{
+	return parse_target(c, config[1], config, 0);
+}
+
+static int parse_evdev_pin(char *dev, char *code, control_type_t *type)
+{
+	int chip;
+	int n;
+
+	// find_chip() keeps whatever is not a gpiochip as given:
+	chip = find_chip(dev);
+	if (chip < 0)
+		return -1;
+	if (strncmp(gpio_chip[chip], "gpiochip", 8) == 0) {
+		ERR("%s is not an input device.", dev);
+		return -1;
+	}
+	gpio_evdev[chip] = 1;
+	if (strncmp(code, "rel:", 4) == 0) {
+		n = atoi(code + 4);
+		if (n < 0 || n >= EVDEV_RELS)
+			return -1;
+		*type = ROTARY;
+		return PIN(chip, EVDEV_REL_LINE(n));
+	}
+	if (strncmp(code, "key:", 4) == 0) {
+		n = atoi(code + 4);
+		if (n < 0 || n >= EVDEV_KEYS)
+			return -1;
+		*type = SWITCH;
+		return PIN(chip, EVDEV_KEY_LINE(n));
+	}
+	return -1;
+}
+
+static int parse_iio_pin(char *dev, char *channel)
+{
+	int chip;
+	int n;
+
+	chip = find_chip(dev);
+	if (chip < 0)
+		return -1;
+	if (strncmp(gpio_chip[chip], "gpiochip", 8) == 0 || gpio_evdev[chip]) {
+		ERR("%s is not an IIO device.", dev);
+		return -1;
+	}
+	gpio_iio[chip] = 1;
+	n = atoi(channel);
+	if (n < 0 || n >= IIO_CHANNELS)
+		return -1;
+	return PIN(chip, n);
+}
+
+static int pin_in_use(int pin)
+{
+	// only used while parsing, so a linear scan is fine.
+	// the last controller is the one we're parsing.
+	for (int i = 0; i < ncontrollers - 1; i++) {
+		// chords share their pins with switches:
+		if (controller[i].target == SLAVE || controller[i].type == CHORD)
+			continue;
+		// a switch can have one controller per gesture:
+		if (controller[i].pin1 == pin && controller[i].type == SWITCH
+		    && controller[ncontrollers - 1].type == SWITCH
+		    && controller_cfg[i].gesture != controller_cfg[ncontrollers - 1].gesture)
+			continue;
+		if (controller[i].pin1 == pin)
+			return 1;
+		if (controller[i].type == ROTARY && controller_cfg[i].pin2 == pin)
+			return 1;
+	}
+	return 0;
+}
+
+// an earlier controller on exactly the same input, whose targets this
+// one adds to. returns its index, or -1 if there is none:
+static int find_primary(control_t *c)
+{
+	control_t *p;
+
+	for (int i = 0; i < ncontrollers - 1; i++) {
+		p = &controller[i];
+		if (p->target == SLAVE || controller_cfg[i].primary >= 0)
+			continue;
+		if (p->type != c->type || p->pin1 != c->pin1 || controller_cfg[i].pin2 != CFG(c)->pin2
+		    || controller_cfg[i].gesture != CFG(c)->gesture)
+			continue;
+		if (c->type == CHORD && (controller_cfg[i].chord_size != CFG(c)->chord_size
+		    || memcmp(controller_cfg[i].chord_pins, CFG(c)->chord_pins, CFG(c)->chord_size * sizeof(unsigned int))))
+			continue;
+		return i;
+	}
+	return -1;
+}
+
+static control_t *add_controller()
+{
+	static int size = 0;
+	control_t *tmp;
+	control_cfg_t *cfg;
+
+	// grow the registry in one contiguous block. pointers into it are
+	// only stable once parsing is done.
+	if (ncontrollers == size) {
+		size = size ? 2 * size : 16;
+		tmp = realloc(controller, size * sizeof(control_t));
+		if (tmp == NULL) {
+			ERR("realloc() failed.");
+			return NULL;
+		}
+		controller = tmp;
+		cfg = realloc(controller_cfg, size * sizeof(control_cfg_t));
+		if (cfg == NULL) {
+			ERR("realloc() failed.");
+			return NULL;
+		}
+		controller_cfg = cfg;
+	}
+	memset(&controller[ncontrollers], 0, sizeof(control_t));
+	memset(&controller_cfg[ncontrollers], 0, sizeof(control_cfg_t));
+	controller_cfg[ncontrollers].primary = -1;
+	return &controller[ncontrollers++];
+}
+
 static int match(char *string1, char *string2)
 {
         if (strncmp(string1, string2, strlen(string2)) == 0) {
@@ -142,28 +595,36 @@ int parse_cmdline(int argc, char *argv[])
 {
 	int o;
 	int i;
+	int pin;
 	char *config[MAXARG];
 
 	int ncontrols = 0;
 	control_t *c;
-	control_t *d;
+	control_t *tmp;
 
 	static struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'V'},
 		{"verbose", no_argument, 0, 'v'},
+		{"busy-poll", required_argument, 0, 'B'},
+		{"handover", required_argument, 0, 'H'},
+		{"poll", required_argument, 0, 'P'},
+		{"matrix", required_argument, 0, 'm'},
+		{"evdev", required_argument, 0, 'e'},
+		{"analog", required_argument, 0, 'a'},
+		{"chord", required_argument, 0, 'c'},
 		{"rotary", required_argument, 0, 'r'},
 		{"switch", required_argument, 0, 's'},
 		{"slave-rotary", required_argument, 0, 'R'},
 		{"slave-switch", required_argument, 0, 'S'},
+		{"output", required_argument, 0, 'O'},
 		{0, 0, 0, 0}
 	};
 
 	while (1) {
 		int optind = 0;
 		c = NULL;
-		d = NULL;
-		o = getopt_long(argc, argv, ":hVvr:s:U:R:S:", long_options, &optind);
+		o = getopt_long(argc, argv, ":hVvB:H:P:m:r:s:e:a:c:U:R:S:O:", long_options, &optind);
 		if (o == -1)
 			break;
 		i = tokenize(optarg, config);
@@ -175,140 +636,207 @@ int parse_cmdline(int argc, char *argv[])
 		case 'v':
 			verbose = 1;
 			continue; // skip controls update at end
-		case 'r':
-			c = calloc(sizeof(control_t), 1);
-			d = calloc(sizeof(control_t), 1);
-			if (c == NULL || d == NULL) {
-				ERR("calloc() failed.");
+		case 'B':
+			if (config[0] == NULL || (busy_cpu = atoi(config[0])) < 0) {
+				ERR("busy-poll needs a cpu number.");
 				goto error;
 			}
+			continue; // skip controls update at end
+		case 'H':
+			if (config[0] == NULL) {
+				ERR("handover needs a socket path.");
+				goto error;
+			}
+			handover_path = config[0];
+			continue; // skip controls update at end
+		case 'P':
+			pin = (config[0] == NULL) ? -1 : find_chip(config[0]);
+			if (pin < 0) {
+				ERR("poll needs a valid chip.");
+				goto error;
+			}
+			gpio_poll[pin] = (config[1] == NULL) ? DEFAULT_POLL_RATE : atoi(config[1]);
+			if (gpio_poll[pin] < 1) {
+				ERR("poll rate must be positive.");
+				goto error;
+			}
+			continue; // skip controls update at end
+		case 'm':
+			if (add_matrix(config))
+				goto error;
+			continue; // skip controls update at end
+		case 'O':
+			if (config[0] == NULL || load_output(config[0]))
+				goto error;
+			continue; // skip controls update at end
+		case 'r':
+			c = add_controller();
+			if (c == NULL)
+				goto error;
+			c->type = ROTARY;
+			CFG(c)->res = 2;
+			i = parse_options(c, config, i);
+			if (i < 0)
+				goto error;
 			if (i < 3) {
 				ERR("Not enough options for -r.");
 				goto error;
 			}
-			c->pin1 = atoi(config[0]);
-			if (c->pin1 < 0 || c->pin1 >= MAXGPIO) {
+			pin = parse_pin(config[0]);
+			if (pin < 0) {
 				ERR("clk value out of range.");
 				goto error;
 			}
-			if (controller[c->pin1] != NULL) {
-				ERR("clk pin already assigned.");
+			c->pin1 = pin;
+			pin = parse_pin(config[1]);
+			if (pin < 0) {
+				ERR("dt value of of range.");
 				goto error;
 			}
-			c->pin2 = atoi(config[1]);
-			if (c->pin2 < 0 || c->pin2 >= MAXGPIO) {
-				ERR("dt value of of range.");
+			CFG(c)->pin2 = pin;
+			CFG(c)->primary = find_primary(c);
+			if (CFG(c)->primary < 0 && pin_in_use(c->pin1)) {
+				ERR("clk pin already assigned.");
 				goto error;
 			}
-			if (controller[c->pin2] != NULL) {
+			if ((CFG(c)->primary < 0 && pin_in_use(CFG(c)->pin2)) || CFG(c)->pin2 == c->pin1) {
 				ERR("dt pin already assigned.");
 				goto error;
 			}
-			controller[c->pin1] = c;
-			c->type = ROTARY;
-			c->param1 = calloc(sizeof(char), MAXNAME);
-			c->param2 = calloc(sizeof(char), MAXNAME);
-			if (c->param1 == NULL || c->param2 == NULL) {
-				ERR("calloc() failed.");
+			if (parse_rotary_target(c, config))
 				goto error;
-			}
-#ifdef HAVE_JACK
-			if (match(config[2], "jack")) {
-				if (parse_cmdline_rotary_JACK(c, config))
-					goto error;
-				use_jack = 1;
-			} else
-#endif
-#ifdef HAVE_ALSA
-			if (match(config[2], "alsa")) {
-				if (parse_cmdline_rotary_ALSA(c, config))
-					goto error;
-				use_alsa = 1;
-			} else
-#endif
-#ifdef HAVE_OSC
-			if (match(config[2], "osc")) {
-				if (parse_cmdline_rotary_OSC(c, config))
-					goto error;
-				use_osc = 1;
-			} else
-			if (match(config[2], "master")) {
-				if (parse_cmdline_rotary_MASTER(c, config))
-					goto error;
-				use_osc = 1;
-			} else
-#endif
-			if (match(config[2], "stdout")) {
-				if (parse_cmdline_rotary_STDOUT(c, config))
-					goto error;
-				use_stdout = 1;
-			} else {
-				ERR("Unknown type '%s'.", config[2]);
+			if (INPUT_CFG(c)->accel > 1 && c->target == MASTER) {
+				ERR("accel= does not work with master rotaries.");
 				goto error;
 			}
-			controller[c->pin2] = d;
-			d->type = AUX;
-			d->target = c->target;
 			break;
 
 		case 's':
-			c = calloc(sizeof(control_t), 1);
-			if (c == NULL) {
-				ERR("calloc() failed.");
+			c = add_controller();
+			if (c == NULL)
+				goto error;
+			c->type = SWITCH;
+			i = parse_options(c, config, i);
+			if (i < 0)
 				goto error;
-			}
 			if (i < 2) {
 				ERR("Not enough options for -s.");
 				goto error;
 			}
-			c->pin1 = atoi(config[0]);
-			if (c->pin1 < 0 || c->pin1 >= MAXGPIO) {
+			pin = parse_pin(config[0]);
+			if (pin < 0) {
 				ERR("sw value out of range.");
 				goto error;
 			}
-			if (controller[c->pin1] != NULL) {
+			c->pin1 = pin;
+			CFG(c)->primary = find_primary(c);
+			if (CFG(c)->primary < 0 && pin_in_use(c->pin1)) {
 				ERR("sw pin already assigned.");
 				goto error;
 			}
-			controller[c->pin1] = c;
-			c->type = SWITCH;
-			c->param1 = calloc(sizeof(char), MAXNAME);
-			c->param2 = calloc(sizeof(char), MAXNAME);
-#ifdef HAVE_JACK
-			if (match(config[1], "jack")) {
-				if (parse_cmdline_switch_JACK(c, config))
-					goto error;
-				use_jack = 1;
-			} else
-#endif
-#ifdef HAVE_ALSA
-			if (match(config[1], "alsa")) {
-				if (parse_cmdline_switch_ALSA(c, config))
-					goto error;
-				use_alsa = 1;
-			} else
-#endif
-#ifdef HAVE_OSC
-			if (match(config[1], "osc")) {
-				if (parse_cmdline_switch_OSC(c, config))
-					goto error;
-				use_osc = 1;
-			} else
-			if (match(config[1], "master")) {
-				if (parse_cmdline_switch_MASTER(c, config))
-					goto error;
-				use_osc = 1;
-			} else
-#endif
-			if (match(config[1], "stdout")) {
-				if (parse_cmdline_switch_STDOUT(c, config))
+			if (parse_switch_target(c, config))
+				goto error;
+			break;
+		case 'e':
+			c = add_controller();
+			if (c == NULL)
+				goto error;
+			CFG(c)->res = 2;
+			if (i < 3) {
+				ERR("Not enough options for -e.");
+				goto error;
+			}
+			// the code decides the type, which the options depend on:
+			pin = parse_evdev_pin(config[0], config[1], &c->type);
+			if (pin < 0) {
+				ERR("Invalid evdev code '%s'.", config[1]);
+				goto error;
+			}
+			i = parse_options(c, config, i);
+			if (i < 0)
+				goto error;
+			if (i < 3) {
+				ERR("Not enough options for -e.");
+				goto error;
+			}
+			c->pin1 = pin;
+			// a kernel-decoded rotary has no dt line:
+			CFG(c)->pin2 = pin;
+			CFG(c)->primary = find_primary(c);
+			if (CFG(c)->primary < 0 && pin_in_use(c->pin1)) {
+				ERR("%s is already assigned.", config[1]);
+				goto error;
+			}
+			if (c->type == ROTARY) {
+				if (parse_rotary_target(c, config))
 					goto error;
-				use_stdout = 1;
 			} else {
-				ERR("Unknown type '%s'.", config[2]);
+				// switches have one pin less in front of the type:
+				if (parse_switch_target(c, config + 1))
+					goto error;
+			}
+			if (INPUT_CFG(c)->accel > 1 && c->target == MASTER) {
+				ERR("accel= does not work with master rotaries.");
+				goto error;
+			}
+			break;
+		case 'a':
+			c = add_controller();
+			if (c == NULL)
+				goto error;
+			c->type = ANALOG;
+			CFG(c)->hysteresis = DEFAULT_HYSTERESIS;
+			CFG(c)->decimate = DEFAULT_DECIMATE;
+			i = parse_options(c, config, i);
+			if (i < 0)
+				goto error;
+			if (i < 3) {
+				ERR("Not enough options for -a.");
+				goto error;
+			}
+			pin = parse_iio_pin(config[0], config[1]);
+			if (pin < 0) {
+				ERR("Invalid IIO channel '%s'.", config[1]);
+				goto error;
+			}
+			c->pin1 = pin;
+			CFG(c)->primary = find_primary(c);
+			if (CFG(c)->primary < 0 && pin_in_use(c->pin1)) {
+				ERR("channel already assigned.");
+				goto error;
+			}
+			// analog inputs set absolute values, but use the same
+			// target arguments as rotaries:
+			if (parse_rotary_target(c, config))
+				goto error;
+			if (c->target == MASTER) {
+				ERR("Analog inputs can't be masters.");
 				goto error;
 			}
 			break;
+		case 'c':
+			c = add_controller();
+			if (c == NULL)
+				goto error;
+			c->type = CHORD;
+			i = parse_options(c, config, i);
+			if (i < 0)
+				goto error;
+			if (i < 2) {
+				ERR("Not enough options for -c.");
+				goto error;
+			}
+			CFG(c)->chord_size = parse_pin_list(config[0], &CFG(c)->chord_pins);
+			if (CFG(c)->chord_size < 2 || CFG(c)->chord_size > MAXCHORDSWITCHES) {
+				ERR("A chord needs 2 to %d valid switch pins.", MAXCHORDSWITCHES);
+				goto error;
+			}
+			c->pin1 = CFG(c)->chord_pins[0];
+			CFG(c)->primary = find_primary(c);
+			// chords are dispatched like switches:
+			if (parse_switch_target(c, config))
+				goto error;
+			break;
 #ifdef HAVE_OSC
 #  ifdef HAVE_ALSA
 		case 'U':
@@ -324,11 +852,9 @@ int parse_cmdline(int argc, char *argv[])
 			osc_url = strncpy(osc_url, config[0], MAXNAME);
 			continue; // skip controls update at end
 		case 'R':
-			c = calloc(sizeof(control_t), 1);
-			if (c == NULL) {
-				ERR("calloc() failed.");
+			c = add_controller();
+			if (c == NULL)
 				goto error;
-			}
 			c->param1 = calloc(sizeof(char), MAXNAME);
 			c->param2 = calloc(sizeof(char), MAXNAME);
 			if (c->param1 == NULL || c->param2 == NULL) {
@@ -337,16 +863,14 @@ int parse_cmdline(int argc, char *argv[])
 			}
 			if (parse_cmdline_rotary_SLAVE(c, config))
 				goto error;
-			controller[c->pin1] = c;
+			c->out = &output_ALSA;
+			output_ALSA.used = 1;
 			use_slave = 1;
-			use_alsa = 1;
 			break;
 		case 'S':
-			c = calloc(sizeof(control_t), 1);
-			if (c == NULL) {
-				ERR("calloc() failed.");
+			c = add_controller();
+			if (c == NULL)
 				goto error;
-			}
 			c->param1 = calloc(sizeof(char), MAXNAME);
 			c->param2 = calloc(sizeof(char), MAXNAME);
 			if (c->param1 == NULL || c->param2 == NULL) {
@@ -355,9 +879,9 @@ int parse_cmdline(int argc, char *argv[])
 			}
 			if (parse_cmdline_switch_SLAVE(c, config))
 				goto error;
-			controller[c->pin1] = c;
+			c->out = &output_ALSA;
+			output_ALSA.used = 1;
 			use_slave = 1;
-			use_alsa = 1;
 			break;
 #  endif
 #endif
@@ -380,22 +904,34 @@ int parse_cmdline(int argc, char *argv[])
 		ERR("You need to specifiy -U with -R and -S.");
 		goto error;
 	}
+	// now that we know how many we have, trim the registry to size:
+	tmp = realloc(controller, ncontrollers * sizeof(control_t));
+	if (tmp != NULL)
+		controller = tmp;
+	// and chain up the targets of each input, in command line order:
+	for (int k = 0; k < ncontrollers; k++) {
+		if (controller_cfg[k].primary < 0)
+			continue;
+		c = &controller[controller_cfg[k].primary];
+		while (c->also != NULL)
+			c = c->also;
+		c->also = &controller[k];
+	}
 	return EXIT_CLEAN;
  error:{
-		if (c != NULL) {
-			if (c->param1 != NULL)
-				free(c->param1);
-			if (c->param2 != NULL)
+		for (int k = 0; k < ncontrollers; k++) {
+			c = &controller[k];
+			// slaves point param2 to a string constant
+			if (c->target != SLAVE)
 				free(c->param2);
-			free(c);
-		}
-		if (d != NULL) {
-			if (d->param1 != NULL)
-				free(d->param1);
-			if (d->param2 != NULL)
-				free(d->param2);
-			free(d);
+			free(c->param1);
+			free(CFG(c)->chord_pins);
 		}
+		free(controller);
+		free(controller_cfg);
+		controller = NULL;
+		controller_cfg = NULL;
+		ncontrollers = 0;
 		printf("Use -h for help.\n");
 		return EXIT_ERR;
 	}
@@ -16,47 +16,111 @@
 
 */
 
+/* The queue of MIDI messages for the JACK process callback.
+ *
+ * Any thread may write, only process() reads. Producers used to take
+ * a mutex around jack_ringbuffer_write(), which a non-RT thread could
+ * hold while being preempted, so now every message gets a slot of its
+ * own in a bounded MPSC queue (D. Vyukov's design): producers claim a
+ * slot by advancing the tail with a compare-and-swap, and publish it by
+ * bumping the slot's sequence number. The consumer only ever touches
+ * the head and the slots, and never waits: a slot that is claimed but
+ * not yet published simply ends this period's read, so messages come
+ * out in the order they were claimed, and never half-written.
+ */
+
 #include "ringbuffer.h"
-#include <jack/ringbuffer.h>
-#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "globals.h"
 
-// event ringbuffer and lock
-static jack_ringbuffer_t *buf;
-static pthread_mutex_t buflock = PTHREAD_MUTEX_INITIALIZER;
+typedef struct {
+	// head + 1 once published, head + nslots once read:
+	atomic_size_t seq;
+	unsigned char msg[MSG_SIZE];
+} slot_t;
+
+static slot_t *slots = NULL;
+static size_t nslots = 0; // a power of two
+static atomic_size_t tail; // next slot to claim, shared by producers
+static size_t head; // next slot to read, consumer only
 
 int setup_ringbuffer(int nbytes)
 {
 	DBG("Setting up ringbuffer of %d bytes.", nbytes);
-	buf = jack_ringbuffer_create(nbytes);
-	if (buf == NULL) {
-	        ERR("Could not create JACK ringbuffer.");
+	nslots = 1;
+	while (nslots * 2 * MSG_SIZE <= (size_t)nbytes)
+		nslots *= 2;
+	slots = calloc(nslots, sizeof(slot_t));
+	if (slots == NULL) {
+	        ERR("Could not allocate ringbuffer.");
 	        return -ENOMEM;
         }
-	jack_ringbuffer_mlock(buf);
+	for (size_t i = 0; i < nslots; i++) {
+		atomic_init(&slots[i].seq, i);
+	}
+	atomic_init(&tail, 0);
+	head = 0;
+	// the process callback must not page fault:
+	mlock(slots, nslots * sizeof(slot_t));
 	return 0;
 }
 
 int shutdown_ringbuffer()
 {
 	DBG("Shutting down ringbuffer");
-	jack_ringbuffer_free(buf);
+	munlock(slots, nslots * sizeof(slot_t));
+	free(slots);
+	slots = NULL;
 	return 0;
 }
 
 int ringbuffer_write(unsigned char *msg, size_t size)
 {
-	int nbytes;
-	// there can be multiple writer threads, ensure only
-	// one can write at the same time:
-	pthread_mutex_lock(&buflock);
-	nbytes = jack_ringbuffer_write(buf, (char *)msg, size);
-	pthread_mutex_unlock(&buflock);
-	return nbytes;
+	size_t pos, seq;
+	intptr_t diff;
+	slot_t *s;
+
+	if (size != MSG_SIZE)
+		return 0;
+	pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	for (;;) {
+		s = &slots[pos & (nslots - 1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			// free, try to claim it. on failure, pos is reloaded:
+			if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// still holds a message from one round ago, we're full:
+			return 0;
+		} else {
+			// someone else claimed it first:
+			pos = atomic_load_explicit(&tail, memory_order_relaxed);
+		}
+	}
+	memcpy(s->msg, msg, MSG_SIZE);
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+	return MSG_SIZE;
 }
 
 int ringbuffer_read(unsigned char *msg, size_t size)
 {
-	return jack_ringbuffer_read(buf, (char *)msg, size);
+	slot_t *s = &slots[head & (nslots - 1)];
+
+	if (size != MSG_SIZE)
+		return 0;
+	if (atomic_load_explicit(&s->seq, memory_order_acquire) != head + 1)
+		return 0; // empty, or the next message isn't complete yet
+	memcpy(msg, s->msg, MSG_SIZE);
+	// hand the slot back to the producers for the next round:
+	atomic_store_explicit(&s->seq, head + nslots, memory_order_release);
+	head++;
+	return MSG_SIZE;
 }
@@ -38,12 +38,8 @@ int parse_cmdline_rotary_SLAVE(control_t * c, char *config[])
 {
 	c->type = ROTARY;
 	c->target = SLAVE;
-	if (slave_index < MAXSLAVE) {
-		c->pin1 = MAXGPIO + slave_index++;
-	} else {
-		ERR("Too many slaves. Compile-time limit is %d.", MAXSLAVE);
-		return -1;
-	}
+	// slaves have no pins, just number them:
+	c->pin1 = slave_index++;
 	if (config[0] == NULL) {
 		ERR("control must not be empty.");
 		return -1;
@@ -65,13 +61,10 @@ int parse_cmdline_rotary_SLAVE(control_t * c, char *config[])
 int parse_cmdline_switch_SLAVE(control_t * c, char *config[])
 {
 	c->type = SWITCH;
+	c->urgent = 1;
 	c->target = SLAVE;
-	if (slave_index < MAXSLAVE) {
-		c->pin1 = MAXGPIO + slave_index++;
-	} else {
-		ERR("Too many slaves. Compile-time limit is %d.", MAXSLAVE);
-		return -1;
-	}
+	// slaves have no pins, just number them:
+	c->pin1 = slave_index++;
 	if (config[0] == NULL) {
 		ERR("control must not be empty.");
 		return -1;
@@ -18,11 +18,14 @@
 
 #include "slave_process.h"
 #include <string.h>
+#include <unistd.h>
 #include <lo/lo.h>
 #include <errno.h>
 #include "globals.h"
+#include "handover.h"
+#include "eventloop.h"
 
-static lo_server_thread server;
+static lo_server server;
 static void (*user_callback)();
 
 static void handle_error(int num, const char* m, const char* path) {
@@ -51,9 +54,24 @@ static int handle_all(const char* path, const char* types,
 
 int setup_SLAVE(char* osc_url, void (*callback))
 {
+        int fd;
+
         DBG("Setting up SLAVE.");
-        server = lo_server_thread_new_from_url(osc_url, &handle_error);
         user_callback = callback;
+        fd = adopt_HANDOVER_socket();
+        if (fd >= 0) {
+                // liblo can't adopt a socket, so we let it bind one
+                // anywhere and then put our predecessor's in its place:
+                server = lo_server_new_with_proto(NULL, LO_UDP, &handle_error);
+                if (server != NULL && dup2(fd, lo_server_get_socket_fd(server)) < 0) {
+                        ERR("Could not take over the OSC socket: errno = %d (%s).", errno, strerror(errno));
+                        lo_server_free(server);
+                        server = NULL;
+                }
+                close(fd);
+        } else {
+                server = lo_server_new_from_url(osc_url, &handle_error);
+        }
         if (server == NULL) {
                 ERR("Could not create OSC server at %s.", osc_url);
                 return -ENOANO;
@@ -61,10 +79,19 @@ int setup_SLAVE(char* osc_url, void (*callback))
         return 0;
 }
 
+int get_SLAVE_fd()
+{
+        // only a datagram socket carries everything there is to hand
+        // over, stream servers have one more per connection:
+        if (server == NULL || lo_url_get_protocol_id(osc_url) != LO_UDP)
+                return -1;
+        return lo_server_get_socket_fd(server);
+}
+
 int setup_SLAVE_handler(char* path, void* data) {
         DBG("Setting up SLAVE handler for '%s'.", path);
         lo_method m;
-        m = lo_server_thread_add_method(server, path, "i", &handle_usermsg, data);
+        m = lo_server_add_method(server, path, "i", &handle_usermsg, data);
         if (m == NULL) {
                 ERR("Could not add OSC path handler at '%s'.", path);
                 return -ENOANO;
@@ -73,24 +100,27 @@ int setup_SLAVE_handler(char* path, void* data) {
 }
 
 
+static void handle_socket(void *data __attribute__((unused))) {
+        // everything that has arrived, but don't wait for more.
+        // liblo allocates each message it receives, so unlike the
+        // rest of the event path, slave input does use the heap:
+        while (lo_server_recv_noblock(server, 0) > 0)
+                ;
+}
+
 int start_SLAVE() {
         DBG("Starting SLAVE.");
-        int e;
         // apparently, the order of handlers is important.
         // if this is added first, it will eat all messages.
-        lo_server_thread_add_method(server, NULL, NULL, handle_all, NULL);
-        e = lo_server_thread_start(server);
-        if (e < 0) {
-                ERR("Could not start OSC server thread (error no. %d).", e);
-                return e;
-        }
-        return 0;
+        lo_server_add_method(server, NULL, NULL, handle_all, NULL);
+        // messages are handled in the event loop, together with
+        // everything else:
+        return eventloop_add(lo_server_get_socket_fd(server), &handle_socket, NULL);
 }
 
 int shutdown_SLAVE()
 {
         DBG("Shutting down SLAVE.");
-        lo_server_thread_stop(server);
-        lo_server_thread_free(server);
+        lo_server_free(server);
         return 0;
 }
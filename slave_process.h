@@ -24,6 +24,7 @@
 int setup_SLAVE(char* osc_url, void (*user_callback));
 int start_SLAVE();
 int shutdown_SLAVE();
+int get_SLAVE_fd();
 int setup_SLAVE_handler(char* path, void* data);
 
 #endif
@@ -20,11 +20,17 @@
 #include <stdio.h>
 #include <string.h>
 #include "globals.h"
+#include "stdout_cmdline.h"
 
-void update_STDOUT(control_t * c)
+int update_STDOUT(control_t * c)
 {
-	fprintf(stdout, "%03d\t%05d\n", c->pin1, c->value);
+	if (PIN_CHIP(c->pin1)) {
+		fprintf(stdout, "%d:%03d\t%05d\n", PIN_CHIP(c->pin1), PIN_LINE(c->pin1), c->value);
+	} else {
+		fprintf(stdout, "%03d\t%05d\n", c->pin1, c->value);
+	}
 	fflush(stdout);
+	return 0;
 }
 
 char *setup_STDOUT_format(char *c)
@@ -44,3 +50,15 @@ char *setup_STDOUT_format(char *c)
 	return NULL;
 
 }
+
+output_t output_STDOUT = {
+	.abi = OUTPUT_ABI,
+	.name = "stdout",
+	.help_rotary = &help_rotary_STDOUT,
+	.help_switch = &help_switch_STDOUT,
+	.parse_rotary = &parse_cmdline_rotary_STDOUT,
+	.parse_switch = &parse_cmdline_switch_STDOUT,
+	.update = &update_STDOUT,
+	// a pipe fills up when nobody reads it:
+	.blocking = 1
+};
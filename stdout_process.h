@@ -20,8 +20,11 @@
 #define STDOUT_PROCESSING_H
 
 #include "globals.h"
+#include "output.h"
 
-void update_STDOUT(control_t * c);
+extern output_t output_STDOUT;
+
+int update_STDOUT(control_t * c);
 char *setup_STDOUT_format(char *c);
 
 #endif
@@ -0,0 +1,104 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* A minimal output plugin, see "Writing output plugins" in the README.
+ * It prints "name value" to stdout for each update:
+ *
+ *   gpioctl -O build/test/example_output.so -r 17,27,example,volume
+ *
+ * wscript also builds it with the wrong ABI, as wrong_abi.so, which
+ * gpioctl must refuse. output_plugin.sh runs both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../output.h"
+
+#ifndef EXAMPLE_ABI
+#define EXAMPLE_ABI OUTPUT_ABI
+#endif
+
+static void help_rotary()
+{
+	printf("    ...,example,name[,min[,max[,step]]]\n");
+	printf("               name:    printed in front of each value\n");
+	printf("               min:     minimum value, default 0\n");
+	printf("               max:     maximum value, default 100\n");
+	printf("               step:    the step size per click, default 1\n");
+}
+
+static void help_switch()
+{
+	printf("    ...,example,name[,toggle]\n");
+	printf("               name:    printed in front of each value\n");
+	printf("               toggle:  can be 0 (momentary on) or 1 (toggled on/off)\n");
+}
+
+static int parse_name(control_t *c, char *name)
+{
+	if (name == NULL || strlen(name) < 1) {
+		ERR("example needs a name.");
+		return -1;
+	}
+	strncpy(c->param1, name, MAXNAME - 1);
+	return 0;
+}
+
+// config[] is as for the built-in targets: config[3] is our first argument.
+static int parse_rotary(control_t *c, char *config[])
+{
+	if (parse_name(c, config[3]))
+		return -1;
+	c->min = (config[4] == NULL) ? 0 : atoi(config[4]);
+	c->max = (config[5] == NULL) ? 100 : atoi(config[5]);
+	c->step = (config[6] == NULL) ? 1 : atoi(config[6]);
+	c->value = c->min;
+	return 0;
+}
+
+// switches have one pin less, so config[2] is our first argument.
+static int parse_switch(control_t *c, char *config[])
+{
+	if (parse_name(c, config[2]))
+		return -1;
+	c->toggle = (config[3] == NULL) ? 0 : atoi(config[3]);
+	c->min = 0;
+	c->max = 1;
+	c->value = c->min;
+	return 0;
+}
+
+static int update(control_t *c)
+{
+	fprintf(stdout, "%s %d\n", (char *)c->param1, c->value);
+	fflush(stdout);
+	return 0;
+}
+
+output_t gpioctl_output = {
+	.abi = EXAMPLE_ABI,
+	.name = "example",
+	.help_rotary = &help_rotary,
+	.help_switch = &help_switch,
+	.parse_rotary = &parse_rotary,
+	.parse_switch = &parse_switch,
+	.update = &update,
+	// stdout can block, so we get a worker:
+	.blocking = 1
+};
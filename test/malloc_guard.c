@@ -0,0 +1,110 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Catch heap allocations on the event path. Linked into a test build
+ * (./waf configure --malloc-guard), this replaces the allocator, and
+ * run_eventloop() arms it while it runs. Startup and shutdown may
+ * allocate as they like. Every allocation in between, from any thread,
+ * is reported with its caller, and if there were any, gpioctl exits with
+ * status 3 instead of its own. malloc_guard.sh drives such a build.
+ * Slave input (-R, -S) is left out: liblo allocates every message it
+ * receives, and we can't do anything about it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#define GUARD_STATUS 3
+
+void malloc_guard(int on);
+
+// glibc's own allocator, which we hand everything on to:
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static atomic_int armed = 0;
+static atomic_ulong allocations = 0;
+
+static void report(const char *fn, size_t size, void *caller)
+{
+	char msg[128];
+	int n;
+
+	if (!atomic_load(&armed))
+		return;
+	atomic_fetch_add(&allocations, 1);
+	// no stdio streams in here, they might allocate themselves:
+	n = snprintf(msg, sizeof(msg), "malloc_guard: %s(%zu) from %p in the event loop.\n", fn, size, caller);
+	if (write(STDERR_FILENO, msg, n) < 0)
+		return;
+}
+
+void *malloc(size_t size)
+{
+	report("malloc", size, __builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	report("calloc", n * size, __builtin_return_address(0));
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	report("realloc", size, __builtin_return_address(0));
+	return __libc_realloc(p, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	report("posix_memalign", size, __builtin_return_address(0));
+	*p = __libc_memalign(align, size);
+	return (*p == NULL) ? ENOMEM : 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	report("aligned_alloc", size, __builtin_return_address(0));
+	return __libc_memalign(align, size);
+}
+
+// called by run_eventloop() when it starts and when it returns:
+void malloc_guard(int on)
+{
+	atomic_store(&armed, on);
+}
+
+__attribute__((destructor))
+static void verdict()
+{
+	unsigned long n = atomic_load(&allocations);
+
+	atomic_store(&armed, 0);
+	if (n == 0)
+		return;
+	fprintf(stderr, "malloc_guard: %lu allocations in the event loop.\n", n);
+	fflush(NULL);
+	_exit(GUARD_STATUS);
+}
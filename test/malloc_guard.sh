@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# feed a guarded build (./waf configure --malloc-guard && ./waf) from fifos
+# that stand in for an IIO ADC and an input device, and fail if anything
+# was allocated in the event loop. no hardware needed, and nothing has to
+# listen on the OSC port.
+
+GPIOCTL=${GPIOCTL:-../build/gpioctl}
+OSC=${OSC:-osc.udp://127.0.0.1:7777}
+ADC=$(mktemp -u /tmp/gpioctl-adc.XXXXXX)
+INPUT=$(mktemp -u /tmp/gpioctl-input.XXXXXX)
+EVENTS=$(mktemp /tmp/gpioctl-events.XXXXXX)
+
+mkfifo "$ADC" "$INPUT" || exit 1
+trap 'rm -f "$ADC" "$INPUT" "$EVENTS"' EXIT
+# keep a writer on the fifos, or gpioctl sees them hang up in between:
+exec 3<>"$ADC"
+exec 4<>"$INPUT"
+
+# a struct input_event on 64 bit: a zero timestamp, then type, code and
+# value, little-endian:
+event() {
+	printf '\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0'"$1"
+}
+# REL_X up and down, and KEY_A pressed and released:
+for i in $(seq 10); do
+	event '\x02\x00\x00\x00\x01\x00\x00\x00'
+	event '\x01\x00\x1e\x00\x01\x00\x00\x00'
+	event '\x02\x00\x00\x00\xff\xff\xff\xff'
+	event '\x01\x00\x1e\x00\x00\x00\x00\x00'
+done > "$EVENTS"
+
+# plain, coalesced, and one input with two targets, for the ADC, and the
+# preserialised OSC messages for all of them. the rotary and the switch
+# each go to OSC and stdout:
+"$GPIOCTL" -v \
+	-a "$ADC",0,stdout,fader0 \
+	-a "$ADC",1,stdout,fader1,0,127,1,0,coalesce=20 \
+	-a "$ADC",2,stdout,fader2 \
+	-a "$ADC",2,stdout,fader2,-60,0 \
+	-a "$ADC",2,osc,"$OSC",/fader2 \
+	-e "$INPUT",rel:0,osc,"$OSC",/dial \
+	-e "$INPUT",rel:0,stdout,dial \
+	-e "$INPUT",key:30,osc,"$OSC",/button,1 \
+	-e "$INPUT",key:30,stdout,button \
+	> /dev/null &
+PID=$!
+
+# three 16 bit channels per scan, random samples move all faders:
+for i in $(seq 40); do
+	head -c 3000 /dev/urandom >&3
+	cat "$EVENTS" >&4
+	sleep 0.05
+done
+kill -TERM $PID
+wait $PID
+STATUS=$?
+
+case $STATUS in
+0)	echo "ok: no allocations in the event loop." ;;
+3)	echo "FAILED: the event loop allocated, see above." ;;
+*)	echo "FAILED: gpioctl exited with status $STATUS." ;;
+esac
+exit $STATUS
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+# load the example output plugin (./waf configure --tests && ./waf) and
+# feed it from a fifo that stands in for an IIO ADC, then make sure a
+# plugin built for another ABI is refused. no hardware needed.
+
+BUILD=${BUILD:-../build}
+GPIOCTL=${GPIOCTL:-$BUILD/gpioctl}
+FIFO=$(mktemp -u /tmp/gpioctl-adc.XXXXXX)
+OUT=$(mktemp /tmp/gpioctl-out.XXXXXX)
+
+mkfifo "$FIFO" || exit 1
+trap 'rm -f "$FIFO" "$OUT"' EXIT
+# keep a writer on the fifo, or gpioctl sees it hang up in between:
+exec 3<>"$FIFO"
+
+"$GPIOCTL" -O "$BUILD/test/example_output.so" \
+	-a "$FIFO",0,example,fader \
+	> "$OUT" &
+PID=$!
+for i in $(seq 10); do
+	head -c 200 /dev/urandom >&3
+	sleep 0.05
+done
+kill -TERM $PID
+wait $PID
+STATUS=$?
+if [ $STATUS -ne 0 ]; then
+	echo "FAILED: gpioctl exited with status $STATUS."
+	exit 1
+fi
+if ! grep -q "^fader [0-9]*$" "$OUT"; then
+	echo "FAILED: the example plugin sent nothing."
+	exit 1
+fi
+echo "ok: the example plugin sent $(wc -l < "$OUT") updates."
+
+# if it were loaded, gpioctl would run until the timeout:
+ERRORS=$(timeout 2 "$GPIOCTL" -O "$BUILD/test/wrong_abi.so" -a "$FIFO",0,example,fader 2>&1 > /dev/null)
+STATUS=$?
+if [ $STATUS -eq 0 ] || [ $STATUS -eq 124 ] || ! echo "$ERRORS" | grep -q "another version"; then
+	echo "FAILED: a plugin with the wrong ABI was loaded."
+	exit 1
+fi
+echo "ok: a plugin with the wrong ABI was refused."
+exit 0
@@ -0,0 +1,124 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* Hammer the MIDI ringbuffer from several producers at once, while one
+ * consumer reads like the JACK process callback would. Every producer
+ * numbers its messages, so a lost, duplicated or torn message shows up
+ * as a gap in that producer's sequence. ./waf configure --tests builds
+ * it, then from the test directory:
+ *
+ *   ../build/test/ringbuffer_stress [producers [messages]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "ringbuffer.h"
+#include "globals.h"
+
+#define MAXPRODUCERS 16
+// the sequence number is spread over the low 7 bits of all three bytes,
+// like a MIDI message, with the producer in the first byte:
+#define MAXMESSAGES (1 << 17)
+
+int verbose = 0;
+
+static int nproducers = 4;
+static int nmessages = 100000;
+static atomic_int done;
+static unsigned long retries[MAXPRODUCERS];
+
+static void *produce(void *arg)
+{
+	int id = (int)(long)arg;
+	unsigned char msg[MSG_SIZE];
+
+	for (int seq = 0; seq < nmessages; seq++) {
+		msg[0] = 0x80 | (id << 3) | (seq >> 14);
+		msg[1] = (seq >> 7) & 0x7f;
+		msg[2] = seq & 0x7f;
+		while (ringbuffer_write(msg, MSG_SIZE) != MSG_SIZE) {
+			retries[id]++;
+			sched_yield();
+		}
+	}
+	atomic_fetch_add(&done, 1);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t producer[MAXPRODUCERS];
+	int next[MAXPRODUCERS] = { 0 };
+	unsigned char msg[MSG_SIZE];
+	unsigned long total = 0, reads = 0;
+	int id, seq, errors = 0;
+
+	if (argc > 1)
+		nproducers = atoi(argv[1]);
+	if (argc > 2)
+		nmessages = atoi(argv[2]);
+	if (nproducers < 1 || nproducers > MAXPRODUCERS || nmessages < 1 || nmessages > MAXMESSAGES) {
+		fprintf(stderr, "usage: %s [producers (1-%d) [messages (1-%d)]]\n", argv[0], MAXPRODUCERS, MAXMESSAGES);
+		return 1;
+	}
+	if (setup_ringbuffer(JACK_BUFSIZE))
+		return 1;
+	for (long i = 0; i < nproducers; i++) {
+		pthread_create(&producer[i], NULL, &produce, (void *)i);
+	}
+	// the consumer, reading until all producers are done and it's empty:
+	for (;;) {
+		int finished = atomic_load(&done) == nproducers;
+		int n = 0;
+
+		while (ringbuffer_read(msg, MSG_SIZE) == MSG_SIZE) {
+			n++;
+			id = (msg[0] >> 3) & 0x0f;
+			seq = ((msg[0] & 0x07) << 14) | ((msg[1] & 0x7f) << 7) | (msg[2] & 0x7f);
+			if (!(msg[0] & 0x80) || (msg[1] & 0x80) || (msg[2] & 0x80)
+			    || id >= nproducers || seq != next[id]) {
+				if (errors++ < 10)
+					fprintf(stderr, "bad message %02x %02x %02x, expected producer %d at %d\n",
+					    msg[0], msg[1], msg[2], id, id < nproducers ? next[id] : -1);
+				continue;
+			}
+			next[id]++;
+		}
+		total += n;
+		if (n == 0 && finished)
+			break;
+		if (n == 0)
+			sched_yield();
+		else
+			reads++;
+	}
+	for (int i = 0; i < nproducers; i++) {
+		pthread_join(producer[i], NULL);
+		if (next[i] != nmessages) {
+			fprintf(stderr, "producer %d: got %d of %d messages\n", i, next[i], nmessages);
+			errors++;
+		}
+		printf("producer %d: %d messages, %lu retries on a full buffer\n", i, next[i], retries[i]);
+	}
+	printf("%lu messages in %lu reads, %d errors.\n", total, reads, errors);
+	shutdown_ringbuffer();
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/* A hashed timer wheel on a single timerfd.
+ *
+ * Timers are hashed into slots by the tick they expire on, so adding
+ * and removing one is O(1), and each tick only looks at one slot.
+ * Timers further out than one revolution stay in their slot until
+ * their round comes up. The timerfd only ticks while timers are
+ * pending, so an idle wheel costs nothing, and a busy one costs one
+ * wakeup per tick, however many timers there are.
+ */
+
+#include "timerwheel.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include "globals.h"
+
+// must be a power of two:
+#define WHEEL_SLOTS 256
+
+static wheel_timer_t *slots[WHEEL_SLOTS];
+static unsigned long long now = 0; // in ticks
+static int tick_us = 0;
+static int pending = 0;
+static int tfd = -1;
+
+static int arm(int on)
+{
+	struct itimerspec period = { 0 };
+
+	if (on) {
+		period.it_interval.tv_sec = tick_us / 1000000;
+		period.it_interval.tv_nsec = (tick_us % 1000000) * 1000L;
+		period.it_value = period.it_interval;
+	}
+	if (timerfd_settime(tfd, 0, &period, NULL)) {
+		ERR("timerfd_settime: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+int setup_timerwheel(int us)
+{
+	DBG("Setting up timer wheel with %d us ticks.", us);
+	if (us < 1) {
+		ERR("Invalid tick length %d us.", us);
+		return -EINVAL;
+	}
+	tick_us = us;
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		ERR("timerfd_create: errno = %d (%s).", errno, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+int shutdown_timerwheel()
+{
+	DBG("Shutting down timer wheel.");
+	if (tfd >= 0)
+		close(tfd);
+	tfd = -1;
+	return 0;
+}
+
+int timerwheel_fd()
+{
+	return tfd;
+}
+
+void timerwheel_add(wheel_timer_t *t, int ms)
+{
+	unsigned long long ticks = ((unsigned long long)ms * 1000 + tick_us - 1) / tick_us;
+	wheel_timer_t **slot;
+
+	timerwheel_del(t);
+	t->expires = now + (ticks ? ticks : 1);
+	slot = &slots[t->expires & (WHEEL_SLOTS - 1)];
+	t->next = *slot;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+	if (pending++ == 0)
+		arm(1);
+}
+
+void timerwheel_del(wheel_timer_t *t)
+{
+	if (t->pprev == NULL)
+		return;
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	pending--;
+}
+
+void timerwheel_expire()
+{
+	uint64_t ticks;
+	wheel_timer_t *t, *next, *due;
+
+	if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return; // spurious wakeup
+	while (ticks-- && pending) {
+		now++;
+		// collect everything that's due first, so that callbacks can
+		// re-arm their timers without confusing the walk:
+		due = NULL;
+		for (t = slots[now & (WHEEL_SLOTS - 1)]; t != NULL; t = next) {
+			next = t->next;
+			if (t->expires > now)
+				continue;
+			timerwheel_del(t);
+			t->next = due;
+			due = t;
+		}
+		for (t = due; t != NULL; t = next) {
+			next = t->next;
+			t->next = NULL;
+			t->fn(t);
+		}
+	}
+	if (pending == 0)
+		arm(0);
+}
@@ -0,0 +1,37 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+// a timer is embedded in whatever it belongs to. fn is called from
+// timerwheel_expire() once the timer is due, and may re-arm it.
+typedef struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer **pprev; // NULL unless pending
+	unsigned long long expires; // in ticks
+	void (*fn)(struct wheel_timer *t);
+} wheel_timer_t;
+
+int setup_timerwheel(int tick_us);
+int shutdown_timerwheel();
+int timerwheel_fd();
+void timerwheel_add(wheel_timer_t *t, int ms);
+void timerwheel_del(wheel_timer_t *t);
+void timerwheel_expire();
+
+#endif
@@ -0,0 +1,256 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/* Output workers.
+ *
+ * Writing to a target can block: ALSA drivers may take their time, a
+ * stdout pipe fills up when nobody reads it, and liblo resolves host
+ * names. None of that must hold up the event loop, which has to decode
+ * the next encoder edge in time. So each output that may block gets a
+ * thread of its own, fed through a bounded queue. The event loop only
+ * computes the new value and queues a copy of the controller, the worker
+ * does the slow part.
+ *
+ * All targets of an output share its worker, so that their updates keep
+ * their order. Each worker has two lanes: switches, chords
+ * and controllers marked urgent=1 always go before queued rotary and
+ * analog updates, so a mute never waits for the tail of a fader sweep.
+ * At worst, it waits for the one update that is being written out.
+ */
+
+#define _GNU_SOURCE // for pthread_timedjoin_np()
+#include "worker.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+
+enum {
+	URGENT,
+	NORMAL,
+	NLANES
+};
+static const char *lane_names[] = { "urgent", "normal" };
+
+typedef struct {
+	control_t *ctl; // to coalesce updates of the same controller
+	control_t snap; // what the target gets to see
+	unsigned long long queued; // in us
+} job_t;
+
+typedef struct {
+	job_t queue[WORKER_QUEUE];
+	int head;
+	int count;
+	// queue-to-target latency, in us:
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long sum;
+	unsigned long delivered;
+} lane_t;
+
+typedef struct worker {
+	output_t *out;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	lane_t lanes[NLANES];
+	int count; // in all lanes
+	int stopping;
+	// queued or being written out. the event loop reads it without
+	// taking the lock, see worker_busy():
+	atomic_int pending;
+	unsigned long coalesced;
+	unsigned long dropped;
+} worker_t;
+
+// how long a worker may take to deliver what's left on shutdown, in s:
+#define WORKER_DRAIN_TIMEOUT 1
+
+static unsigned long long usec_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
+
+// a worker cancelled in pthread_cond_wait() wakes up with the lock held:
+static void unlock_worker(void *arg)
+{
+	worker_t *w = arg;
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *run_worker(void *arg)
+{
+	worker_t *w = arg;
+	unsigned long long queued, lat;
+	lane_t *l;
+	control_t c;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		pthread_cleanup_push(&unlock_worker, w);
+		while (w->count == 0 && !w->stopping)
+			pthread_cond_wait(&w->wake, &w->lock);
+		pthread_cleanup_pop(0);
+		// drain what is left before stopping:
+		if (w->count == 0)
+			break;
+		l = &w->lanes[URGENT];
+		if (l->count == 0)
+			l = &w->lanes[NORMAL];
+		c = l->queue[l->head].snap;
+		queued = l->queue[l->head].queued;
+		l->head = (l->head + 1) % WORKER_QUEUE;
+		l->count--;
+		w->count--;
+		pthread_mutex_unlock(&w->lock);
+		w->out->update(&c);
+		atomic_fetch_sub_explicit(&w->pending, 1, memory_order_release);
+		lat = usec_now() - queued;
+		NFO("%s% 3d:%d\t-> %s\t% 3d", control_types[c.type], PIN_CHIP(c.pin1), PIN_LINE(c.pin1), control_targets[c.target], c.value);
+		pthread_mutex_lock(&w->lock);
+		if (lat < l->min)
+			l->min = lat;
+		if (lat > l->max)
+			l->max = lat;
+		l->sum += lat;
+		l->delivered++;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+int setup_worker(output_t *o)
+{
+	worker_t *w;
+	int err;
+
+	DBG("Setting up %s worker.", o->name);
+	w = calloc(1, sizeof(worker_t));
+	if (w == NULL) {
+		ERR("Could not allocate %s worker.", o->name);
+		return -ENOMEM;
+	}
+	w->out = o;
+	for (int i = 0; i < NLANES; i++) {
+		w->lanes[i].min = ~0ULL;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	err = pthread_create(&w->thread, NULL, &run_worker, w);
+	if (err) {
+		ERR("Could not start %s worker: %s.", o->name, strerror(err));
+		free(w);
+		return -err;
+	}
+	o->worker = w;
+	return 0;
+}
+
+int shutdown_worker(output_t *o)
+{
+	struct timespec deadline;
+	worker_t *w = o->worker;
+	int err = 0;
+
+	DBG("Shutting down %s worker.", o->name);
+	pthread_mutex_lock(&w->lock);
+	w->stopping = 1;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += WORKER_DRAIN_TIMEOUT;
+	if (pthread_timedjoin_np(w->thread, NULL, &deadline)) {
+		// stuck in a target that doesn't take any more, like
+		// a stdout pipe nobody reads:
+		ERR("%s worker is stuck, giving up on %d updates.", o->name, w->count);
+		pthread_cancel(w->thread);
+		pthread_join(w->thread, NULL);
+		err = -EBUSY;
+	}
+	for (int j = 0; j < NLANES; j++) {
+		lane_t *l = &w->lanes[j];
+		if (l->delivered)
+			NFO("%s latency (%s): min %llu us, avg %llu us, max %llu us over %lu updates.",
+			    o->name, lane_names[j], l->min, l->sum / l->delivered, l->max, l->delivered);
+	}
+	if (w->coalesced || w->dropped)
+		NFO("%s worker fell behind: %lu updates coalesced, %lu dropped.",
+		    o->name, w->coalesced, w->dropped);
+	pthread_cond_destroy(&w->wake);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+	o->worker = NULL;
+	return err;
+}
+
+int worker_send(control_t *c)
+{
+	worker_t *w = c->out->worker;
+	unsigned long long now = usec_now();
+	lane_t *l;
+	int i;
+
+	l = &w->lanes[c->urgent ? URGENT : NORMAL];
+	pthread_mutex_lock(&w->lock);
+	if (l->count < WORKER_QUEUE) {
+		i = (l->head + l->count) % WORKER_QUEUE;
+		l->queue[i].ctl = c;
+		// we run on the event loop, which is the only thread that
+		// writes controllers, so a plain copy is consistent:
+		l->queue[i].snap = *c;
+		l->queue[i].queued = now;
+		l->count++;
+		w->count++;
+		atomic_fetch_add_explicit(&w->pending, 1, memory_order_relaxed);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+		return 0;
+	}
+	// the worker is stuck. only the latest value of a controller
+	// matters, so overwrite the newest queued one if there is one.
+	// it keeps its place, and the time it was queued:
+	for (int n = l->count - 1; n >= 0; n--) {
+		i = (l->head + n) % WORKER_QUEUE;
+		if (l->queue[i].ctl == c) {
+			l->queue[i].snap = *c;
+			w->coalesced++;
+			pthread_mutex_unlock(&w->lock);
+			return 0;
+		}
+	}
+	w->dropped++;
+	pthread_mutex_unlock(&w->lock);
+	return -ENOBUFS;
+}
+
+// called for every event, so it must not contend for the lock with the
+// worker:
+int worker_busy(output_t *o)
+{
+	worker_t *w = o->worker;
+
+	if (w == NULL)
+		return 0;
+	return atomic_load_explicit(&w->pending, memory_order_acquire) != 0;
+}
@@ -0,0 +1,33 @@
+/*
+  gpioctl
+
+  Copyright (C) 2019 Jörn Nettingsmeier
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "globals.h"
+#include "output.h"
+
+// pending updates per worker and lane. when a lane falls this far behind,
+// updates of controllers already queued replace the queued value:
+#define WORKER_QUEUE 64
+
+int setup_worker(output_t *o);
+int shutdown_worker(output_t *o);
+int worker_send(control_t *c);
+int worker_busy(output_t *o);
+
+#endif